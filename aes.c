@@ -19,8 +19,47 @@
 
 // #include <stdint.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
 #include "aes.h"
 
+void aes_cpu_probe(void);
+
+static pthread_once_t aes_cpu_once     = PTHREAD_ONCE_INIT;
+static unsigned       aes_cpu_detected = 0;
+
+extern unsigned aes_cpu_features(void) {
+  // CPUID is serializing and slow, so only probe the CPU once
+  pthread_once(&aes_cpu_once, aes_cpu_probe);
+  return aes_cpu_detected;
+}
+
+void aes_cpu_probe(void) {
+  unsigned features = 0;
+  #if defined(__x86_64__) || defined(__i386__)
+    unsigned a = 0, b = 0, c = 0, d = 0, xcr0 = 0, xcr0_hi = 0;
+    // Leaf 1 reports AES-NI, SSSE3 and whether XGETBV may be used
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return;
+    if (c & bit_AES)   features |= AES_CPU_AESNI;
+    if (c & bit_SSSE3) features |= AES_CPU_SSSE3;
+    if (!(c & bit_OSXSAVE)) {
+      aes_cpu_detected = features;
+      return;
+    }
+    // Ensure the OS saves the YMM (and optionally ZMM) register state
+    __asm__ volatile ("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0 & 0x06) == 0x06 && __get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+      if (b & bit_AVX2) features |= AES_CPU_AVX2;
+      // The wide AES path needs VAES on 512-bit registers with ZMM state
+      if ((b & bit_AVX512F) && (c & bit_VAES) && (xcr0 & 0xE0) == 0xE0)
+        features |= AES_CPU_VAES;
+    }
+  #endif
+  aes_cpu_detected = features;
+}
+
 // uint8_t aes_galois_mul2(uint8_t input) {
 //   // Left shift the input by 1 bit, then XOR it with 0x1B if the MSB was 1
 //   return (input << 1) ^ (0x1B & (uint8_t)((signed char)input >> 7));
@@ -20,79 +20,253 @@
 #include <stdio.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "aes.h"
 #include "aes128.h"
+#include "aes128bs.h"
+#include "aes128ni.h"
 
-void aes128_add_round_key(const aes128_state_t* in, aes128_state_t* out,
-  const aes128_key_t* key, const uint8_t round_num);
+void aes128_engine_detect(void);
 void aes128_key_advance(const uint8_t* in, uint8_t* out,
   const uint8_t round_num);
-void aes128_sbox_repl(const aes128_state_t* in, aes128_state_t* out);
 void aes128_shift_col(const aes128_state_t* in, aes128_state_t* out,
   const uint8_t column, uint8_t amount);
-void aes128_shift_cols(const aes128_state_t* in, aes128_state_t* out);
 void aes128_mix_row(const uint8_t* in, uint8_t* out);
-void aes128_mix_rows(const aes128_state_t* in, aes128_state_t* out);
+uint32_t aes128_load_word(const uint8_t* in);
+uint32_t aes128_swap_word(uint32_t in);
+void aes128_ttable_load_key(const aes128_key_t* key, uint32_t* round_key);
+void aes128_ttable_round(const uint32_t* in, uint32_t* out,
+  const uint32_t* round_key);
+void aes128_ttable_final(const uint32_t* in, uint8_t* out,
+  const uint32_t* round_key);
+void aes128_ttable_ctr_cache(const uint32_t* round_key, const uint32_t n0,
+  const uint32_t n1, const uint64_t counter, uint32_t* cache);
 
-pthread_mutex_t io = PTHREAD_MUTEX_INITIALIZER;
+static const char* aes128_engine_names[AES128_ENGINE_COUNT] = {
+  "soft", "bitslice", "aesni", "vaes"
+};
+
+static pthread_once_t  aes128_engine_once   = PTHREAD_ONCE_INIT;
+static aes128_engine_t aes128_engine_active = AES128_ENGINE_SOFT;
+
+extern aes128_engine_t aes128_engine(void) {
+  // Probe the CPU the first time an engine is requested
+  pthread_once(&aes128_engine_once, aes128_engine_detect);
+  return aes128_engine_active;
+}
+
+extern const char* aes128_engine_name(aes128_engine_t engine) {
+  return engine < AES128_ENGINE_COUNT ? aes128_engine_names[engine] : "?";
+}
+
+extern int aes128_engine_select(aes128_engine_t engine) {
+  // Make sure detection has run so it cannot override this choice later
+  pthread_once(&aes128_engine_once, aes128_engine_detect);
+  if (!aes128_engine_supported(engine)) return 0;
+  aes128_engine_active = engine;
+  return 1;
+}
+
+extern int aes128_engine_supported(aes128_engine_t engine) {
+  #if AES128NI_AVAILABLE || AES128BS_AVAILABLE
+    unsigned features = aes_cpu_features();
+  #endif
+  switch (engine) {
+    case AES128_ENGINE_SOFT:     return 1;
+    #if AES128BS_AVAILABLE
+      case AES128_ENGINE_BITSLICE: return (features & AES_CPU_SSSE3) != 0;
+    #endif
+    #if AES128NI_AVAILABLE
+      case AES128_ENGINE_AESNI:    return (features & AES_CPU_AESNI) != 0;
+      case AES128_ENGINE_VAES:     return (features & AES_CPU_AESNI) &&
+                                          (features & AES_CPU_VAES);
+    #endif
+    default:                     return 0;
+  }
+}
+
+void aes128_engine_detect(void) {
+  // Prefer the widest supported engine
+  for (int i = AES128_ENGINE_COUNT - 1; i >= 0; --i)
+    if (aes128_engine_supported((aes128_engine_t)i)) {
+      aes128_engine_active = (aes128_engine_t)i; break;
+    }
+  // Allow the environment to pin a specific engine (e.g. for comparisons)
+  aes128_engine_t pinned;
+  if (aes128_engine_pinned(&pinned)) aes128_engine_active = pinned;
+}
+
+extern int aes128_engine_pinned(aes128_engine_t* engine) {
+  // Only a supported engine named in full counts as pinned; anything else
+  // leaves the choice to detection
+  const char* name = getenv("AES128_ENGINE");
+  for (int i = 0; name != NULL && i < AES128_ENGINE_COUNT; ++i)
+    if (strcmp(name, aes128_engine_names[i]) == 0 &&
+        aes128_engine_supported((aes128_engine_t)i)) {
+      if (engine != NULL) *engine = (aes128_engine_t)i;
+      return 1;
+    }
+  return 0;
+}
 
 extern void aes128_encrypt(const aes128_key_t* key, aes128_state_t* state) {
+  switch (aes128_engine()) {
+    #if AES128NI_AVAILABLE
+      // Use the hardware instructions when the active engine provides them
+      case AES128_ENGINE_VAES:
+      case AES128_ENGINE_AESNI:    aes128ni_encrypt(key, state); return;
+    #endif
+    default:                     break;
+  }
+  // Otherwise dispatch to the round engine selected at build time; the
+  // bitsliced engine only pays off across whole lane groups, so single
+  // blocks stay on the table engine even when it is active
+  #if AES128_TTABLE
+    aes128_encrypt_ttable(key, state);
+  #else
+    aes128_encrypt_bytes(key, state);
+  #endif
+}
+
+extern void aes128_encrypt_bytes(const aes128_key_t* key,
+    aes128_state_t* state) {
   // Repeat for 11 rounds of the algorithm
   for (uint8_t round_num = 0; round_num < 11; ++round_num) {
-    #if (DEBUG > 1)
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[AES] IN   : ");
-      for (size_t i = 0; i < 16; ++i)
-        fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-      fprintf(stderr, "\n");
-      pthread_mutex_unlock(&io);
-    #endif
     // Substitute each byte of the state with one from the S-box
     if (round_num > 0)                   aes128_sbox_repl(state, state);
-    #if (DEBUG > 1)
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[AES] SBOX : ");
-      for (size_t i = 0; i < 16; ++i)
-        fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-      fprintf(stderr, "\n");
-      pthread_mutex_unlock(&io);
-    #endif
     // Perform a circular shift on each column of the state
     if (round_num > 0)                   aes128_shift_cols(state, state);
-    #if (DEBUG > 1)
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[AES] SFTCL: ");
-      for (size_t i = 0; i < 16; ++i)
-        fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-      fprintf(stderr, "\n");
-      pthread_mutex_unlock(&io);
-    #endif
     // Run mix_row() on each row of the state
     if (round_num > 0 && round_num < 10) aes128_mix_rows(state, state);
-    #if (DEBUG > 1)
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[AES] MIXRW: ");
-      for (size_t i = 0; i < 16; ++i)
-        fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-      fprintf(stderr, "\n");
-      pthread_mutex_unlock(&io);
-    #endif
     // XOR the round key with the state
     aes128_add_round_key(state, state, key, round_num);
-    #if (DEBUG > 1)
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[AES] OUT  : ");
-      for (size_t i = 0; i < 16; ++i)
-        fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-      fprintf(stderr, "\n\n");
-      pthread_mutex_unlock(&io);
-    #endif
   }
 }
 
+extern void aes128_encrypt_ttable(const aes128_key_t* key,
+    aes128_state_t* state) {
+  uint32_t rk[44], s[4], t[4];
+  aes128_ttable_load_key(key, rk);
+  // Load each column of the state as a word and add the first round key
+  for (uint8_t i = 0; i < 4; ++i)
+    s[i] = aes128_load_word(state->val + (i << 2)) ^ rk[i];
+  // Run the nine full rounds two at a time, alternating between buffers
+  for (uint8_t round_num = 1; round_num < 9; round_num += 2) {
+    aes128_ttable_round(s, t, rk + ((round_num + 0) << 2));
+    aes128_ttable_round(t, s, rk + ((round_num + 1) << 2));
+  } aes128_ttable_round(s, t, rk + (9 << 2));
+  // The final round omits MixColumns, so fall back to the plain S-box
+  aes128_ttable_final(t, state->val, rk + (10 << 2));
+}
+
+extern void aes128_ctr_keystream(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+    size_t blocks) {
+  #if AES128_TTABLE
+    uint32_t rk[44], s[AES128_SOFT_LANES][4], t[AES128_SOFT_LANES][4];
+    uint32_t cache[5] = {0}; uint64_t cached = 0; int valid = 0;
+    aes128_ttable_load_key(key, rk);
+    // The nonce columns never change, so add the first round key once
+    const uint32_t n0 = aes128_load_word(nonce->val + 0) ^ rk[0];
+    const uint32_t n1 = aes128_load_word(nonce->val + 4) ^ rk[1];
+    while (blocks > 0) {
+      size_t lanes = blocks < AES128_SOFT_LANES ? blocks : AES128_SOFT_LANES;
+      for (size_t j = 0; j < lanes; ++j) {
+        const uint64_t block = counter + j;
+        // Only the low counter byte varies within a run of 256 blocks, so
+        // refresh the cached round 1-2 contributions when the rest changes
+        if (!valid || (block >> 8) != cached) {
+          aes128_ttable_ctr_cache(rk, n0, n1, block, cache);
+          cached = block >> 8; valid = 1;
+        }
+        // Finish rounds one and two from the single varying byte
+        const uint32_t v = cache[0] ^ aes_te3[(uint8_t)block ^ (rk[3] >> 24)];
+        s[j][0] = cache[1] ^ aes_te0[(v      ) & 0xFF];
+        s[j][1] = cache[2] ^ aes_te3[(v >> 24)       ];
+        s[j][2] = cache[3] ^ aes_te2[(v >> 16) & 0xFF];
+        s[j][3] = cache[4] ^ aes_te1[(v >>  8) & 0xFF];
+      }
+      // Interleave the independent blocks round by round so their table
+      // lookups can overlap in the pipeline
+      for (uint8_t round_num = 3; round_num < 9; round_num += 2) {
+        for (size_t j = 0; j < lanes; ++j)
+          aes128_ttable_round(s[j], t[j], rk + ((round_num + 0) << 2));
+        for (size_t j = 0; j < lanes; ++j)
+          aes128_ttable_round(t[j], s[j], rk + ((round_num + 1) << 2));
+      }
+      for (size_t j = 0; j < lanes; ++j) {
+        aes128_ttable_round(s[j], t[j], rk + (9 << 2));
+        aes128_ttable_final(t[j], out[j].val, rk + (10 << 2));
+      }
+      counter += lanes; out += lanes; blocks -= lanes;
+    }
+  #else
+    uint64_t block_counter = 0;
+    // Build and encrypt each counter block with the byte-wise engine
+    for (size_t i = 0; i < blocks; ++i) {
+      block_counter = htonll(counter + i);
+      memcpy(out[i].val,                      nonce->val, sizeof(nonce->val));
+      memcpy(out[i].val + sizeof(nonce->val), &block_counter,
+        sizeof(block_counter));
+      aes128_encrypt_bytes(key, &out[i]);
+    }
+  #endif
+}
+
+extern void aes128_ctr_crypt_lanes(const aes128_key_t* const* keys,
+    const aes128_nonce_t* const* nonces, const uint64_t* counters,
+    uint8_t* const* blocks, size_t lanes) {
+  aes128_state_t key_stream;
+  #if AES128_TTABLE
+    uint32_t rk[AES128_SOFT_LANES][44], s[AES128_SOFT_LANES][4],
+      t[AES128_SOFT_LANES][4];
+    while (lanes > 0) {
+      size_t count = lanes < AES128_SOFT_LANES ? lanes : AES128_SOFT_LANES;
+      // Every lane has its own key and nonce, so build each counter block
+      // in full rather than from the cached round contributions
+      for (size_t j = 0; j < count; ++j) {
+        aes128_ttable_load_key(keys[j], rk[j]);
+        s[j][0] = aes128_load_word(nonces[j]->val + 0) ^ rk[j][0];
+        s[j][1] = aes128_load_word(nonces[j]->val + 4) ^ rk[j][1];
+        s[j][2] = aes128_swap_word((uint32_t)(counters[j] >> 32)) ^ rk[j][2];
+        s[j][3] = aes128_swap_word((uint32_t)counters[j]) ^ rk[j][3];
+      }
+      // Interleave the lanes round by round like the key stream kernel
+      for (uint8_t round_num = 1; round_num < 9; round_num += 2) {
+        for (size_t j = 0; j < count; ++j)
+          aes128_ttable_round(s[j], t[j], rk[j] + ((round_num + 0) << 2));
+        for (size_t j = 0; j < count; ++j)
+          aes128_ttable_round(t[j], s[j], rk[j] + ((round_num + 1) << 2));
+      }
+      for (size_t j = 0; j < count; ++j) {
+        aes128_ttable_round(s[j], t[j], rk[j] + (9 << 2));
+        aes128_ttable_final(t[j], key_stream.val, rk[j] + (10 << 2));
+        for (uint8_t i = 0; i < 16; ++i)
+          blocks[j][i] ^= key_stream.val[i];
+      }
+      keys += count; nonces += count; counters += count; blocks += count;
+      lanes -= count;
+    }
+  #else
+    // The byte-wise engine has nothing to overlap, so take one lane at a
+    // time
+    for (size_t j = 0; j < lanes; ++j) {
+      aes128_ctr_keystream(nonces[j], keys[j], counters[j], &key_stream, 1);
+      for (uint8_t i = 0; i < 16; ++i)
+        blocks[j][i] ^= key_stream.val[i];
+    }
+  #endif
+}
+
 extern void aes128_key_init(aes128_key_t* key) {
+  #if AES128NI_AVAILABLE
+    if (aes128_engine() >= AES128_ENGINE_AESNI) {
+      aes128ni_key_init(key);
+      return;
+    }
+  #endif
   // Zero all key slots after the first
   memset(key->val + (1 << 4), 0, sizeof(key->val) - (1 << 4));
   // Calculate the full key schedule from the original key
@@ -101,20 +275,85 @@ extern void aes128_key_init(aes128_key_t* key) {
     aes128_key_advance(key->val + (i << 4), key->val + (j << 4), j);
 }
 
-void aes128_add_round_key(const aes128_state_t* in, aes128_state_t* out,
-    const aes128_key_t* key, const uint8_t round_num) {
+uint32_t aes128_load_word(const uint8_t* in) {
+  // Assemble a little-endian word independent of the host byte order
+  return (uint32_t)in[0]       | (uint32_t)in[1] <<  8 |
+         (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+uint32_t aes128_swap_word(uint32_t in) {
+  // Reverse the byte order of a word (compiles to a single instruction)
+  return (in >> 24) | ((in >> 8) & 0xFF00) | ((in << 8) & 0xFF0000) |
+         (in << 24);
+}
+
+void aes128_ttable_load_key(const aes128_key_t* key, uint32_t* round_key) {
+  // Load the whole key schedule as column words
+  for (uint8_t i = 0; i < 44; ++i)
+    round_key[i] = aes128_load_word(key->val + (i << 2));
+}
+
+void aes128_ttable_round(const uint32_t* in, uint32_t* out,
+    const uint32_t* round_key) {
+  // Each output column takes row `i` from input column `c + i`, which folds
+  // ShiftRows into the table index; the tables supply SubBytes/MixColumns
+  for (uint8_t c = 0; c < 4; ++c)
+    out[c] = aes_te0[(in[(c + 0) & 3]      ) & 0xFF] ^
+             aes_te1[(in[(c + 1) & 3] >>  8) & 0xFF] ^
+             aes_te2[(in[(c + 2) & 3] >> 16) & 0xFF] ^
+             aes_te3[(in[(c + 3) & 3] >> 24)       ] ^ round_key[c];
+}
+
+void aes128_ttable_final(const uint32_t* in, uint8_t* out,
+    const uint32_t* round_key) {
+  // Apply SubBytes and ShiftRows byte-wise, then add the last round key
+  for (uint8_t c = 0; c < 4; ++c)
+    for (uint8_t r = 0; r < 4; ++r)
+      out[(c << 2) + r] = aes_sbox[(in[(c + r) & 3] >> (r << 3)) & 0xFF] ^
+        (uint8_t)(round_key[c] >> (r << 3));
+}
+
+void aes128_ttable_ctr_cache(const uint32_t* round_key, const uint32_t n0,
+    const uint32_t n1, const uint64_t counter, uint32_t* cache) {
+  uint32_t r1[4];
+  // After the first round key, only the top byte of column three depends on
+  // the low counter byte; zero it so the partial sums exclude it
+  const uint32_t s[4] = {
+    n0, n1, aes128_swap_word((uint32_t)(counter >> 32)) ^ round_key[2],
+    (aes128_swap_word((uint32_t)counter) ^ round_key[3]) & 0x00FFFFFF
+  };
+  // Round one: that byte only feeds column zero through `aes_te3`, so
+  // remove the lookup made for the zeroed placeholder
+  aes128_ttable_round(s, r1, round_key + 4);
+  cache[0] = r1[0] ^ aes_te3[0];
+  // Round two: column zero of round one feeds one row of every column, so
+  // cache each column without that row's term
+  cache[1] = aes_te1[(r1[1] >>  8) & 0xFF] ^ aes_te2[(r1[2] >> 16) & 0xFF] ^
+             aes_te3[(r1[3] >> 24)       ] ^ round_key[8];
+  cache[2] = aes_te0[(r1[1]      ) & 0xFF] ^ aes_te1[(r1[2] >>  8) & 0xFF] ^
+             aes_te2[(r1[3] >> 16) & 0xFF] ^ round_key[9];
+  cache[3] = aes_te0[(r1[2]      ) & 0xFF] ^ aes_te1[(r1[3] >>  8) & 0xFF] ^
+             aes_te3[(r1[1] >> 24)       ] ^ round_key[10];
+  cache[4] = aes_te0[(r1[3]      ) & 0xFF] ^ aes_te2[(r1[1] >> 16) & 0xFF] ^
+             aes_te3[(r1[2] >> 24)       ] ^ round_key[11];
+}
+
+extern void aes128_add_round_key(const aes128_state_t* in,
+    aes128_state_t* out, const aes128_key_t* key, const uint8_t round_num) {
   // XOR each state byte with the corresponding key byte
   for (uint8_t i = 0; i < 16; ++i)
     out->val[i] = in->val[i] ^ key->val[(round_num << 4) + i];
 }
 
-void aes128_sbox_repl(const aes128_state_t* in, aes128_state_t* out) {
+extern void aes128_sbox_repl(const aes128_state_t* in,
+    aes128_state_t* out) {
   // Iterate over each byte of the input and replace it with its S-box value
   for (uint8_t i = 0; i < 16; ++i)
     out->val[i] = aes_sbox[in->val[i]];
 }
 
-void aes128_shift_cols(const aes128_state_t* in, aes128_state_t* out) {
+extern void aes128_shift_cols(const aes128_state_t* in,
+    aes128_state_t* out) {
   // Circular shift each column using its index as the shift amount
   for (uint8_t i = 0; i < 4; ++i)
     aes128_shift_col(in, out, i, i);
@@ -140,7 +379,8 @@ void aes128_shift_col(const aes128_state_t* in, aes128_state_t* out,
   out->val[column + 12] = temp.bytes[3];
 }
 
-void aes128_mix_rows(const aes128_state_t* in, aes128_state_t* out) {
+extern void aes128_mix_rows(const aes128_state_t* in,
+    aes128_state_t* out) {
   // Iterate through each row in the table to mix it
   for (uint8_t i = 0; i < 4; ++i)
     aes128_mix_row(in->val + (i << 2), out->val + (i << 2));
@@ -20,10 +20,29 @@
 #ifndef __AES128_H
 #define __AES128_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "aes.h"
 
+#ifndef AES128_TTABLE
+  #define AES128_TTABLE 1
+#endif
+
+// Number of counter blocks interleaved by the software key stream kernel
+#ifndef AES128_SOFT_LANES
+  #define AES128_SOFT_LANES 2
+#endif
+
+// Block cipher backends that may be selected at runtime
+typedef enum {
+  AES128_ENGINE_SOFT = 0,
+  AES128_ENGINE_BITSLICE,
+  AES128_ENGINE_AESNI,
+  AES128_ENGINE_VAES,
+  AES128_ENGINE_COUNT
+} aes128_engine_t;
+
 typedef struct {
   uint8_t val[8];
 } aes128_nonce_t;
@@ -37,6 +56,26 @@ typedef struct {
 } aes128_state_t;
 
 extern void aes128_encrypt(const aes128_key_t* key, aes128_state_t* state);
+extern void aes128_encrypt_bytes(const aes128_key_t* key,
+  aes128_state_t* state);
+extern void aes128_encrypt_ttable(const aes128_key_t* key,
+  aes128_state_t* state);
+extern void aes128_ctr_keystream(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+  size_t blocks);
+extern void aes128_ctr_crypt_lanes(const aes128_key_t* const* keys,
+  const aes128_nonce_t* const* nonces, const uint64_t* counters,
+  uint8_t* const* blocks, size_t lanes);
 extern void aes128_key_init(aes128_key_t* key);
+extern void aes128_add_round_key(const aes128_state_t* in,
+  aes128_state_t* out, const aes128_key_t* key, const uint8_t round_num);
+extern void aes128_sbox_repl(const aes128_state_t* in, aes128_state_t* out);
+extern void aes128_shift_cols(const aes128_state_t* in, aes128_state_t* out);
+extern void aes128_mix_rows(const aes128_state_t* in, aes128_state_t* out);
+extern aes128_engine_t aes128_engine(void);
+extern const char* aes128_engine_name(aes128_engine_t engine);
+extern int aes128_engine_select(aes128_engine_t engine);
+extern int aes128_engine_supported(aes128_engine_t engine);
+extern int aes128_engine_pinned(aes128_engine_t* engine);
 
 #endif
@@ -0,0 +1,199 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128batch.h"
+#include "aes128ctr.h"
+
+int aes128batch_compare(const void* a, const void* b);
+int aes128batch_search(const void* key, const void* entry);
+int aes128batch_walk_dir(aes128batch_t* batch, const char* path);
+
+extern int aes128batch_init(aes128batch_t* batch) {
+  memset(batch, 0, sizeof(*batch));
+  batch->capacity = 64;
+  batch->files    = calloc(batch->capacity, sizeof(*batch->files));
+  batch->labels   = calloc(batch->capacity, sizeof(*batch->labels));
+  if (batch->files == NULL || batch->labels == NULL) {
+    free(batch->files); free(batch->labels); return 0;
+  } return 1;
+}
+
+extern int aes128batch_add(aes128batch_t* batch, const char* path) {
+  // Double the list whenever it fills up
+  if (batch->count == batch->capacity) {
+    aes128ctr_batch_file_t* files = realloc(batch->files,
+      2 * batch->capacity * sizeof(*files));
+    if (files != NULL) batch->files = files;
+    char** labels = realloc(batch->labels,
+      2 * batch->capacity * sizeof(*labels));
+    if (labels != NULL) batch->labels = labels;
+    if (files == NULL || labels == NULL) return 0;
+    batch->capacity *= 2;
+  }
+  // Label a walked file by its path below the root, and a listed one by
+  // its canonical path; a file that cannot be resolved keeps its name
+  char* copy  = strdup(path);
+  char* label = batch->root > 0 ? strdup(path + batch->root) :
+    realpath(path, NULL);
+  if (label == NULL && batch->root == 0) label = strdup(path);
+  if (copy == NULL || label == NULL) {
+    free(copy); free(label); return 0;
+  }
+  memset(&batch->files[batch->count], 0, sizeof(*batch->files));
+  batch->labels[batch->count] = label;
+  batch->files[batch->count++].path = copy;
+  return 1;
+}
+
+extern int aes128batch_read_list(aes128batch_t* batch, FILE* fp) {
+  char* line = NULL; size_t size = 0; ssize_t length; int ok = 1;
+  // Take one path per line, ignoring blank lines
+  while (ok && (length = getline(&line, &size, fp)) >= 0) {
+    while (length > 0 && (line[length - 1] == '\n' ||
+        line[length - 1] == '\r'))
+      line[--length] = 0;
+    if (length > 0) ok = aes128batch_add(batch, line);
+  }
+  free(line);
+  return ok && !ferror(fp);
+}
+
+extern int aes128batch_walk(aes128batch_t* batch, const char* path) {
+  char root[4096]; size_t length = strlen(path);
+  // Drop trailing slashes so that every child is joined by exactly one and
+  // labels do not depend on how the root was written
+  while (length > 1 && path[length - 1] == '/') --length;
+  if (length == 1 && path[0] == '/') length = 0;
+  if (length >= sizeof(root)) return 0;
+  memcpy(root, path, length); root[length] = 0;
+  batch->root = length + 1;
+  int ok = aes128batch_walk_dir(batch, length > 0 ? root : "/");
+  batch->root = 0;
+  return ok;
+}
+
+int aes128batch_walk_dir(aes128batch_t* batch, const char* path) {
+  char child[4096]; struct dirent* entry; struct stat st;
+  // The root "/" is the only directory that ends in a slash
+  const char* join = path[strlen(path) - 1] == '/' ? "" : "/";
+  DIR* dir = opendir(path);
+  if (dir == NULL) return 0;
+  int ok = 1;
+  // Add every regular file below this directory; symbolic links are not
+  // followed so that no file can be reached (and crypted) twice
+  while (ok && (errno = 0, entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (snprintf(child, sizeof(child), "%s%s%s", path, join,
+        entry->d_name) >= (int)sizeof(child)) {
+      ok = 0; break;
+    }
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN && lstat(child, &st) == 0)
+      type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : 0;
+    if (type == DT_REG)
+      ok = aes128batch_add(batch, child);
+    else if (type == DT_DIR)
+      ok = aes128batch_walk_dir(batch, child);
+  }
+  if (errno != 0) ok = 0;
+  closedir(dir);
+  return ok;
+}
+
+extern int aes128batch_load_nonces(aes128batch_t* batch, const char* path) {
+  char* line = NULL; size_t size = 0; ssize_t length; int ok = 1;
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) return 0;
+  // Sort the files by path so that each manifest line is a binary search
+  aes128ctr_batch_file_t** sorted = calloc(batch->count + 1,
+    sizeof(*sorted));
+  uint8_t* found = calloc(batch->count + 1, 1);
+  if (sorted == NULL || found == NULL) {
+    free(sorted); free(found); fclose(fp); return 0;
+  }
+  for (size_t i = 0; i < batch->count; ++i)
+    sorted[i] = &batch->files[i];
+  qsort(sorted, batch->count, sizeof(*sorted), aes128batch_compare);
+  // Each line holds a 64-bit hexadecimal nonce, a space and then a path
+  while (ok && (length = getline(&line, &size, fp)) >= 0) {
+    while (length > 0 && (line[length - 1] == '\n' ||
+        line[length - 1] == '\r'))
+      line[--length] = 0;
+    if (length == 0 || line[0] == '#') continue;
+    if (length < 18 || line[16] != ' ') {
+      ok = 0; break;
+    }
+    aes128ctr_batch_file_t** match = bsearch(line + 17, sorted,
+      batch->count, sizeof(*sorted), aes128batch_search);
+    if (match == NULL) continue;
+    line[16] = 0; errno = 0; char* end = NULL;
+    uint64_t tmp = strtoull(line, &end, 16);
+    if (errno != 0 || end != line + 16) {
+      ok = 0; break;
+    }
+    tmp = htonll(tmp); memcpy((*match)->nonce.val, &tmp, 8);
+    found[*match - batch->files] = 1;
+  }
+  // Every file of the batch needs a nonce
+  for (size_t i = 0; ok && i < batch->count; ++i)
+    ok = found[i];
+  free(line); free(sorted); free(found); fclose(fp);
+  return ok;
+}
+
+extern void aes128batch_derive_nonces(aes128batch_t* batch,
+    const aes128_nonce_t* nonce, const aes128_key_t* key) {
+  // Derive each nonce from the file's label rather than the path it was
+  // listed under
+  for (size_t i = 0; i < batch->count; ++i)
+    aes128ctr_derive_nonce(nonce, key, batch->labels[i],
+      &batch->files[i].nonce);
+}
+
+extern void aes128batch_destroy(aes128batch_t* batch) {
+  for (size_t i = 0; i < batch->count; ++i) {
+    free((char*)batch->files[i].path); free(batch->labels[i]);
+  }
+  free(batch->files); free(batch->labels);
+  memset(batch, 0, sizeof(*batch));
+}
+
+int aes128batch_compare(const void* a, const void* b) {
+  return strcmp((*(aes128ctr_batch_file_t* const*)a)->path,
+    (*(aes128ctr_batch_file_t* const*)b)->path);
+}
+
+int aes128batch_search(const void* key, const void* entry) {
+  return strcmp((const char*)key,
+    (*(aes128ctr_batch_file_t* const*)entry)->path);
+}
@@ -0,0 +1,49 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128BATCH_H
+#define __AES128BATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "aes128.h"
+#include "aes128ctr.h"
+
+// A growable list of files to crypt together, each with its own nonce.
+// `labels` name each file for nonce derivation: its path below the walked
+// directory, or the canonical absolute path of a listed file, so that the
+// same file gets the same nonce however it was reached. `root` is the
+// length of the directory prefix while a walk is in progress
+typedef struct {
+  aes128ctr_batch_file_t* files;
+  char**                 labels;
+  size_t                 count, capacity, root;
+} aes128batch_t;
+
+extern int aes128batch_init(aes128batch_t* batch);
+extern int aes128batch_add(aes128batch_t* batch, const char* path);
+extern int aes128batch_read_list(aes128batch_t* batch, FILE* fp);
+extern int aes128batch_walk(aes128batch_t* batch, const char* path);
+extern int aes128batch_load_nonces(aes128batch_t* batch, const char* path);
+extern void aes128batch_derive_nonces(aes128batch_t* batch,
+  const aes128_nonce_t* nonce, const aes128_key_t* key);
+extern void aes128batch_destroy(aes128batch_t* batch);
+
+#endif
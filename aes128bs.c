@@ -0,0 +1,197 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128bs.h"
+
+#if AES128BS_AVAILABLE
+
+#include <immintrin.h>
+
+// The last schedule this thread sliced into bit planes, so that a run of
+// calls with the same key only expands it once
+static _Thread_local struct {
+  aes128_key_t           key;
+  aes128bs_key_t         bs_key;
+  int                    valid;
+} aes128bs_local;
+
+const aes128bs_key_t* aes128bs_key_local(const aes128_key_t* key);
+
+// 128-bit kernel: eight blocks per call using SSE2 logic and SSSE3 shuffles
+#define AES128BS_SUFFIX      ssse3
+#define AES128BS_TARGET      __attribute__((target("ssse3")))
+#define AES128BS_VEC         __m128i
+#define AES128BS_LANES       AES128BS_LANES_SSSE3
+#define AES128BS_SET1(x)     _mm_set1_epi8((char)(x))
+#define AES128BS_BCAST(p)    _mm_loadu_si128((const __m128i*)(p))
+#define AES128BS_SRL(v, n)   _mm_srli_epi64((v), (n))
+#define AES128BS_SLL(v, n)   _mm_slli_epi64((v), (n))
+#define AES128BS_SHUF(v, i)  _mm_shuffle_epi8((v), (i))
+#define AES128BS_LOAD(s, k)  _mm_loadu_si128((const __m128i*)(s)[(k)].val)
+#define AES128BS_STORE(s, k, v) \
+  _mm_storeu_si128((__m128i*)(s)[(k)].val, (v))
+#include "aes128bs_kernel.h"
+#undef AES128BS_SUFFIX
+#undef AES128BS_TARGET
+#undef AES128BS_VEC
+#undef AES128BS_LANES
+#undef AES128BS_SET1
+#undef AES128BS_BCAST
+#undef AES128BS_SRL
+#undef AES128BS_SLL
+#undef AES128BS_SHUF
+#undef AES128BS_LOAD
+#undef AES128BS_STORE
+
+// 256-bit kernel: sixteen blocks per call, blocks `k` and `k + 8` sharing a
+// register in its low and high lanes
+#define AES128BS_SUFFIX      avx2
+#define AES128BS_TARGET      __attribute__((target("avx2")))
+#define AES128BS_VEC         __m256i
+#define AES128BS_LANES       AES128BS_LANES_AVX2
+#define AES128BS_SET1(x)     _mm256_set1_epi8((char)(x))
+#define AES128BS_BCAST(p)    _mm256_broadcastsi128_si256( \
+  _mm_loadu_si128((const __m128i*)(p)))
+#define AES128BS_SRL(v, n)   _mm256_srli_epi64((v), (n))
+#define AES128BS_SLL(v, n)   _mm256_slli_epi64((v), (n))
+#define AES128BS_SHUF(v, i)  _mm256_shuffle_epi8((v), (i))
+#define AES128BS_LOAD(s, k)  _mm256_inserti128_si256(_mm256_castsi128_si256( \
+  _mm_loadu_si128((const __m128i*)(s)[(k)].val)),                          \
+  _mm_loadu_si128((const __m128i*)(s)[(k) + 8].val), 1)
+#define AES128BS_STORE(s, k, v) do {                                       \
+    _mm_storeu_si128((__m128i*)(s)[(k)].val,                               \
+      _mm256_castsi256_si128((v)));                                        \
+    _mm_storeu_si128((__m128i*)(s)[(k) + 8].val,                           \
+      _mm256_extracti128_si256((v), 1));                                   \
+  } while (0)
+#include "aes128bs_kernel.h"
+#undef AES128BS_SUFFIX
+#undef AES128BS_TARGET
+#undef AES128BS_VEC
+#undef AES128BS_LANES
+#undef AES128BS_SET1
+#undef AES128BS_BCAST
+#undef AES128BS_SRL
+#undef AES128BS_SLL
+#undef AES128BS_SHUF
+#undef AES128BS_LOAD
+#undef AES128BS_STORE
+
+extern void aes128bs_key_init(const aes128_key_t* key,
+    aes128bs_key_t* bs_key) {
+  // Spread every bit of the key schedule across a full byte mask
+  for (uint8_t r = 0; r < 11; ++r)
+    for (uint8_t i = 0; i < 8; ++i)
+      for (uint8_t p = 0; p < 16; ++p)
+        bs_key->val[r][i][p] = -((key->val[(r << 4) + p] >> i) & 1);
+}
+
+extern void aes128bs_encrypt_blocks(const aes128bs_key_t* key,
+    aes128_state_t* state, size_t blocks) {
+  // Use the widest kernel the CPU supports
+  if (aes_cpu_features() & AES_CPU_AVX2)
+    aes128bs_encrypt_blocks_avx2(key, state, blocks);
+  else aes128bs_encrypt_blocks_ssse3(key, state, blocks);
+}
+
+const aes128bs_key_t* aes128bs_key_local(const aes128_key_t* key) {
+  // Slice the schedule again only when this thread moves to another key
+  if (!aes128bs_local.valid ||
+      memcmp(&aes128bs_local.key, key, sizeof(*key)) != 0) {
+    aes128bs_key_init(key, &aes128bs_local.bs_key);
+    aes128bs_local.key = *key; aes128bs_local.valid = 1;
+  }
+  return &aes128bs_local.bs_key;
+}
+
+extern void aes128bs_encrypt(const aes128_key_t* key, aes128_state_t* state) {
+  aes128bs_encrypt_blocks(aes128bs_key_local(key), state, 1);
+}
+
+extern void aes128bs_ctr_keystream(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+    size_t blocks) {
+  // A run too short to fill a lane group is not worth slicing the key for
+  if (blocks < AES128BS_LANES_SSSE3)
+    aes128_ctr_keystream(nonce, key, counter, out, blocks);
+  else aes128bs_ctr_keystream_keyed(nonce, key, aes128bs_key_local(key),
+    counter, out, blocks);
+}
+
+extern void aes128bs_ctr_keystream_keyed(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const aes128bs_key_t* bs_key, uint64_t counter,
+    aes128_state_t* out, size_t blocks) {
+  // Take whole lane groups of the widest kernel, then of the narrow one
+  size_t wide = (aes_cpu_features() & AES_CPU_AVX2) ?
+    blocks & ~(size_t)(AES128BS_LANES_AVX2 - 1) : 0;
+  size_t sliced = blocks & ~(size_t)(AES128BS_LANES_SSSE3 - 1);
+  // Lay out the counter blocks in place, then encrypt them as a batch
+  for (size_t i = 0; i < sliced; ++i) {
+    uint64_t block_counter = htonll(counter + i);
+    memcpy(out[i].val,                      nonce->val, sizeof(nonce->val));
+    memcpy(out[i].val + sizeof(nonce->val), &block_counter,
+      sizeof(block_counter));
+  }
+  if (wide > 0) aes128bs_encrypt_blocks_avx2(bs_key, out, wide);
+  if (sliced > wide)
+    aes128bs_encrypt_blocks_ssse3(bs_key, out + wide, sliced - wide);
+  // Leave a tail shorter than a lane group to the table engine
+  if (blocks > sliced)
+    aes128_ctr_keystream(nonce, key, counter + sliced, out + sliced,
+      blocks - sliced);
+}
+
+extern void aes128bs_ctr_crypt_lanes(const aes128_key_t* const* keys,
+    const aes128_nonce_t* const* nonces, const uint64_t* counters,
+    uint8_t* const* blocks, size_t lanes) {
+  const aes128_key_t* group[AES128BS_LANES_AVX2];
+  aes128_state_t state[AES128BS_LANES_AVX2];
+  // Only take the wide kernel when there are lanes enough to fill it
+  const size_t width = (aes_cpu_features() & AES_CPU_AVX2) &&
+    lanes > AES128BS_LANES_SSSE3 ? AES128BS_LANES_AVX2 : AES128BS_LANES_SSSE3;
+  while (lanes > 0) {
+    size_t count = lanes < width ? lanes : width;
+    // Lay out one counter block per lane; unused lanes borrow the first
+    // lane's key and are discarded
+    memset(state, 0, sizeof(state));
+    for (size_t j = 0; j < width; ++j) {
+      group[j] = keys[j < count ? j : 0];
+      if (j >= count) continue;
+      uint64_t block_counter = htonll(counters[j]);
+      memcpy(state[j].val, nonces[j]->val, sizeof(nonces[j]->val));
+      memcpy(state[j].val + sizeof(nonces[j]->val), &block_counter,
+        sizeof(block_counter));
+    }
+    if (width == AES128BS_LANES_AVX2)
+      aes128bs_encrypt_keyed_avx2(group, state);
+    else aes128bs_encrypt_keyed_ssse3(group, state);
+    for (size_t j = 0; j < count; ++j)
+      for (uint8_t i = 0; i < 16; ++i)
+        blocks[j][i] ^= state[j].val[i];
+    keys += count; nonces += count; counters += count; blocks += count;
+    lanes -= count;
+  }
+}
+
+#endif
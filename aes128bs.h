@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128BS_H
+#define __AES128BS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+#include "aes128.h"
+
+// The bitsliced kernels need SSSE3 byte shuffles on x86
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define AES128BS_AVAILABLE 1
+#else
+  #define AES128BS_AVAILABLE 0
+#endif
+
+// Only the batched data path is constant-time: aes128_key_init() still
+// indexes the S-box with key bytes, and single blocks passed to
+// aes128_encrypt() go through the table engine, as do key stream runs and
+// tails shorter than one 128-bit lane group
+
+// Blocks processed in parallel by the 128-bit and 256-bit kernels
+#define AES128BS_LANES_SSSE3  8
+#define AES128BS_LANES_AVX2  16
+
+// Round keys expanded into bit planes: `val[round][bit][byte]` is 0xFF when
+// bit `bit` of byte `byte` of that round key is set
+typedef struct {
+  uint8_t val[11][8][16];
+} aes128bs_key_t;
+
+extern void aes128bs_key_init(const aes128_key_t* key,
+  aes128bs_key_t* bs_key);
+extern void aes128bs_encrypt(const aes128_key_t* key, aes128_state_t* state);
+extern void aes128bs_encrypt_blocks(const aes128bs_key_t* key,
+  aes128_state_t* state, size_t blocks);
+extern void aes128bs_ctr_keystream(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+  size_t blocks);
+extern void aes128bs_ctr_keystream_keyed(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const aes128bs_key_t* bs_key, uint64_t counter,
+  aes128_state_t* out, size_t blocks);
+extern void aes128bs_ctr_crypt_lanes(const aes128_key_t* const* keys,
+  const aes128_nonce_t* const* nonces, const uint64_t* counters,
+  uint8_t* const* blocks, size_t lanes);
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+// Bitsliced AES-128 kernel template.  aes128bs.c includes this file once per
+// instruction set after defining:
+//   AES128BS_SUFFIX      suffix appended to every function name
+//   AES128BS_TARGET      function attribute enabling the instruction set
+//   AES128BS_VEC         vector type holding one bit plane
+//   AES128BS_LANES       blocks processed per call of the lane kernel
+//   AES128BS_SET1(x)     broadcast a byte to every vector byte
+//   AES128BS_BCAST(p)    broadcast 16 bytes at `p` to every 128-bit lane
+//   AES128BS_SRL(v, n)   shift each 64-bit element right by `n`
+//   AES128BS_SLL(v, n)   shift each 64-bit element left by `n`
+//   AES128BS_SHUF(v, i)  shuffle bytes within each 128-bit lane
+//   AES128BS_LOAD(s, k)  load register `k` of a lane group from states `s`
+//   AES128BS_STORE(s, k, v) the inverse of AES128BS_LOAD
+//
+// Each 128-bit lane holds eight blocks.  After aes128bs_ortho(), register
+// `i` is the bit plane for bit `i`: byte `p` of the plane carries bit `i` of
+// state byte `p` for each of the eight blocks.  Every operation is a fixed
+// sequence of vector instructions, so timing does not depend on the data.
+
+#define AES128BS_PASTE_(name, suffix) name##_##suffix
+#define AES128BS_PASTE(name, suffix)  AES128BS_PASTE_(name, suffix)
+#define AES128BS_FN(name)             AES128BS_PASTE(name, AES128BS_SUFFIX)
+
+#define AES128BS_SWAPMOVE(a, b, n, m) do {                                 \
+    AES128BS_VEC t_ = (AES128BS_SRL((a), (n)) ^ (b)) & (m);               \
+    (b) ^= t_; (a) ^= AES128BS_SLL(t_, (n));                              \
+  } while (0)
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_ortho)(AES128BS_VEC* q);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_sbox)(AES128BS_VEC* q);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_shift_rows)(AES128BS_VEC* q);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_mix_columns)(AES128BS_VEC* q);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_add_round_key)(AES128BS_VEC* q,
+  const aes128bs_key_t* key, uint8_t round_num);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_lanes)(const aes128bs_key_t* key,
+  aes128_state_t* state);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_blocks)(const aes128bs_key_t* key,
+  aes128_state_t* state, size_t blocks);
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_keyed)(const aes128_key_t* const* keys,
+  aes128_state_t* state);
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_ortho)(AES128BS_VEC* q) {
+  const AES128BS_VEC m1 = AES128BS_SET1(0x55);
+  const AES128BS_VEC m2 = AES128BS_SET1(0x33);
+  const AES128BS_VEC m4 = AES128BS_SET1(0x0F);
+  // Transpose the 8x8 bit matrix at each byte position of the registers;
+  // this converts blocks into bit planes and is its own inverse
+  AES128BS_SWAPMOVE(q[0], q[1], 1, m1); AES128BS_SWAPMOVE(q[2], q[3], 1, m1);
+  AES128BS_SWAPMOVE(q[4], q[5], 1, m1); AES128BS_SWAPMOVE(q[6], q[7], 1, m1);
+  AES128BS_SWAPMOVE(q[0], q[2], 2, m2); AES128BS_SWAPMOVE(q[1], q[3], 2, m2);
+  AES128BS_SWAPMOVE(q[4], q[6], 2, m2); AES128BS_SWAPMOVE(q[5], q[7], 2, m2);
+  AES128BS_SWAPMOVE(q[0], q[4], 4, m4); AES128BS_SWAPMOVE(q[1], q[5], 4, m4);
+  AES128BS_SWAPMOVE(q[2], q[6], 4, m4); AES128BS_SWAPMOVE(q[3], q[7], 4, m4);
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_sbox)(AES128BS_VEC* q) {
+  // Boyar-Peralta S-box circuit; x0 is the most significant bit
+  AES128BS_VEC x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4],
+               x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+  AES128BS_VEC y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14,
+               y15, y16, y17, y18, y19, y20, y21;
+  AES128BS_VEC z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13,
+               z14, z15, z16, z17;
+  AES128BS_VEC t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13,
+               t14, t15, t16, t17, t18, t19, t20, t21, t22, t23, t24, t25,
+               t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37,
+               t38, t39, t40, t41, t42, t43, t44, t45, t46, t47, t48, t49,
+               t50, t51, t52, t53, t54, t55, t56, t57, t58, t59, t60, t61,
+               t62, t63, t64, t65, t66, t67;
+  AES128BS_VEC s0, s1, s2, s3, s4, s5, s6, s7;
+  // Top linear transformation
+  y14 = x3 ^ x5;   y13 = x0 ^ x6;   y9  = x0 ^ x3;   y8  = x0 ^ x5;
+  t0  = x1 ^ x2;   y1  = t0 ^ x7;   y4  = y1 ^ x3;   y12 = y13 ^ y14;
+  y2  = y1 ^ x0;   y5  = y1 ^ x6;   y3  = y5 ^ y8;   t1  = x4 ^ y12;
+  y15 = t1 ^ x5;   y20 = t1 ^ x1;   y6  = y15 ^ x7;  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;  y7  = x7 ^ y11;  y17 = y10 ^ y11; y19 = y10 ^ y8;
+  y16 = t0 ^ y11;  y21 = y13 ^ y16; y18 = x0 ^ y16;
+  // Non-linear section
+  t2  = y12 & y15; t3  = y3 & y6;   t4  = t3 ^ t2;   t5  = y4 & x7;
+  t6  = t5 ^ t2;   t7  = y13 & y16; t8  = y5 & y1;   t9  = t8 ^ t7;
+  t10 = y2 & y7;   t11 = t10 ^ t7;  t12 = y9 & y11;  t13 = y14 & y17;
+  t14 = t13 ^ t12; t15 = y8 & y10;  t16 = t15 ^ t12; t17 = t4 ^ t14;
+  t18 = t6 ^ t16;  t19 = t9 ^ t14;  t20 = t11 ^ t16; t21 = t17 ^ y20;
+  t22 = t18 ^ y19; t23 = t19 ^ y21; t24 = t20 ^ y18;
+  t25 = t21 ^ t22; t26 = t21 & t23; t27 = t24 ^ t26; t28 = t25 & t27;
+  t29 = t28 ^ t22; t30 = t23 ^ t24; t31 = t22 ^ t26; t32 = t31 & t30;
+  t33 = t32 ^ t24; t34 = t23 ^ t33; t35 = t27 ^ t33; t36 = t24 & t35;
+  t37 = t36 ^ t34; t38 = t27 ^ t36; t39 = t29 & t38; t40 = t25 ^ t39;
+  t41 = t40 ^ t37; t42 = t29 ^ t33; t43 = t29 ^ t40; t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0  = t44 & y15; z1  = t37 & y6;  z2  = t33 & x7;  z3  = t43 & y16;
+  z4  = t40 & y1;  z5  = t29 & y7;  z6  = t42 & y11; z7  = t45 & y17;
+  z8  = t41 & y10; z9  = t44 & y12; z10 = t37 & y3;  z11 = t33 & y4;
+  z12 = t43 & y13; z13 = t40 & y5;  z14 = t29 & y2;  z15 = t42 & y9;
+  z16 = t45 & y14; z17 = t41 & y8;
+  // Bottom linear transformation
+  t46 = z15 ^ z16; t47 = z10 ^ z11; t48 = z5 ^ z13;  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;  t51 = z2 ^ z5;   t52 = z7 ^ z8;   t53 = z0 ^ z3;
+  t54 = z6 ^ z7;   t55 = z16 ^ z17; t56 = z12 ^ t48; t57 = t50 ^ t53;
+  t58 = z4 ^ t46;  t59 = z3 ^ t54;  t60 = t46 ^ t57; t61 = z14 ^ t57;
+  t62 = t52 ^ t58; t63 = t49 ^ t58; t64 = z4 ^ t59;  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;  s0  = t59 ^ t63; s6  = t56 ^ ~t62; s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65; s3  = t53 ^ t66; s4  = t51 ^ t66; s5  = t47 ^ t65;
+  s1  = t64 ^ ~s3; s2  = t55 ^ ~t67;
+  q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+  q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_shift_rows)(AES128BS_VEC* q) {
+  static const uint8_t shift_rows[16] = {
+    0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11
+  };
+  // Byte `p` of every plane takes byte `p` of the shifted state
+  const AES128BS_VEC idx = AES128BS_BCAST(shift_rows);
+  for (uint8_t i = 0; i < 8; ++i)
+    q[i] = AES128BS_SHUF(q[i], idx);
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_mix_columns)(AES128BS_VEC* q) {
+  static const uint8_t rotate1[16] = {
+    1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12
+  };
+  static const uint8_t rotate2[16] = {
+    2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13
+  };
+  const AES128BS_VEC r1 = AES128BS_BCAST(rotate1);
+  const AES128BS_VEC r2 = AES128BS_BCAST(rotate2);
+  AES128BS_VEC a1[8], t[8], u[8];
+  // out[r] = 2 * (a[r] ^ a[r + 1]) ^ a[r + 1] ^ a[r + 2] ^ a[r + 3], where
+  // the last two terms are the first sum rotated by two rows
+  for (uint8_t i = 0; i < 8; ++i) {
+    a1[i] = AES128BS_SHUF(q[i], r1); t[i] = q[i] ^ a1[i];
+  }
+  for (uint8_t i = 0; i < 8; ++i)
+    u[i] = a1[i] ^ AES128BS_SHUF(t[i], r2);
+  // Doubling shifts the planes up one bit and reduces by 0x1B
+  q[0] = u[0] ^ t[7];
+  q[1] = u[1] ^ t[0] ^ t[7];
+  q[2] = u[2] ^ t[1];
+  q[3] = u[3] ^ t[2] ^ t[7];
+  q[4] = u[4] ^ t[3] ^ t[7];
+  q[5] = u[5] ^ t[4];
+  q[6] = u[6] ^ t[5];
+  q[7] = u[7] ^ t[6];
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_add_round_key)(AES128BS_VEC* q,
+    const aes128bs_key_t* key, uint8_t round_num) {
+  // XOR each plane with the matching plane of the round key
+  for (uint8_t i = 0; i < 8; ++i)
+    q[i] ^= AES128BS_BCAST(key->val[round_num][i]);
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_lanes)(const aes128bs_key_t* key,
+    aes128_state_t* state) {
+  AES128BS_VEC q[8];
+  // Load the group of blocks and convert it to bit planes
+  for (uint8_t k = 0; k < 8; ++k)
+    q[k] = AES128BS_LOAD(state, k);
+  AES128BS_FN(aes128bs_ortho)(q);
+  AES128BS_FN(aes128bs_add_round_key)(q, key, 0);
+  for (uint8_t round_num = 1; round_num < 10; ++round_num) {
+    AES128BS_FN(aes128bs_sbox)(q);
+    AES128BS_FN(aes128bs_shift_rows)(q);
+    AES128BS_FN(aes128bs_mix_columns)(q);
+    AES128BS_FN(aes128bs_add_round_key)(q, key, round_num);
+  }
+  AES128BS_FN(aes128bs_sbox)(q);
+  AES128BS_FN(aes128bs_shift_rows)(q);
+  AES128BS_FN(aes128bs_add_round_key)(q, key, 10);
+  // Convert the planes back into blocks
+  AES128BS_FN(aes128bs_ortho)(q);
+  for (uint8_t k = 0; k < 8; ++k)
+    AES128BS_STORE(state, k, q[k]);
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_blocks)(const aes128bs_key_t* key,
+    aes128_state_t* state, size_t blocks) {
+  // Encrypt whole lane groups in place
+  for (; blocks >= AES128BS_LANES; blocks -= AES128BS_LANES) {
+    AES128BS_FN(aes128bs_encrypt_lanes)(key, state);
+    state += AES128BS_LANES;
+  }
+  // Pad the final partial group through a scratch buffer
+  if (blocks > 0) {
+    aes128_state_t tail[AES128BS_LANES];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, state, blocks * sizeof(*state));
+    AES128BS_FN(aes128bs_encrypt_lanes)(key, tail);
+    memcpy(state, tail, blocks * sizeof(*state));
+  }
+}
+
+AES128BS_TARGET
+void AES128BS_FN(aes128bs_encrypt_keyed)(const aes128_key_t* const* keys,
+    aes128_state_t* state) {
+  AES128BS_VEC q[8], k[8]; aes128_state_t round_key[AES128BS_LANES];
+  for (uint8_t j = 0; j < 8; ++j)
+    q[j] = AES128BS_LOAD(state, j);
+  AES128BS_FN(aes128bs_ortho)(q);
+  for (uint8_t round_num = 0; round_num < 11; ++round_num) {
+    if (round_num > 0) {
+      AES128BS_FN(aes128bs_sbox)(q);
+      AES128BS_FN(aes128bs_shift_rows)(q);
+    }
+    if (round_num > 0 && round_num < 10)
+      AES128BS_FN(aes128bs_mix_columns)(q);
+    // Every block has its own key, so transpose this round's key of each
+    // block exactly like the data instead of broadcasting one set of planes
+    for (uint8_t j = 0; j < AES128BS_LANES; ++j)
+      memcpy(round_key[j].val, keys[j]->val + (round_num << 4), 16);
+    for (uint8_t j = 0; j < 8; ++j)
+      k[j] = AES128BS_LOAD(round_key, j);
+    AES128BS_FN(aes128bs_ortho)(k);
+    for (uint8_t j = 0; j < 8; ++j)
+      q[j] ^= k[j];
+  }
+  AES128BS_FN(aes128bs_ortho)(q);
+  for (uint8_t j = 0; j < 8; ++j)
+    AES128BS_STORE(state, j, q[j]);
+}
+
+#undef AES128BS_SWAPMOVE
+#undef AES128BS_FN
+#undef AES128BS_PASTE
+#undef AES128BS_PASTE_
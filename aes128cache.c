@@ -0,0 +1,208 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128bs.h"
+#include "aes128cache.h"
+
+uint64_t aes128cache_mix(uint64_t x);
+uint64_t aes128cache_hash(const aes128cache_t* cache, const uint8_t* raw);
+size_t aes128cache_find(aes128cache_t* cache, const uint8_t* raw,
+  uint64_t hash);
+size_t aes128cache_insert(aes128cache_t* cache, const uint8_t* raw,
+  uint64_t hash);
+void aes128cache_unlink(aes128cache_t* cache, size_t index);
+void aes128cache_push(aes128cache_t* cache, size_t index);
+void aes128cache_wipe(void* data, size_t size);
+
+extern int aes128cache_init(aes128cache_t* cache, size_t capacity) {
+  memset(cache, 0, sizeof(*cache));
+  cache->capacity = capacity > 0 ? capacity : AES128CACHE_CAPACITY;
+  // Keep at least as many buckets as entries so that chains stay short
+  size_t buckets = 1;
+  while (buckets < cache->capacity) buckets <<= 1;
+  cache->mask    = buckets - 1;
+  cache->entries = calloc(cache->capacity, sizeof(*cache->entries));
+  cache->buckets = malloc(buckets * sizeof(*cache->buckets));
+  if (cache->entries == NULL || cache->buckets == NULL) {
+    free(cache->entries); free(cache->buckets); return 0;
+  }
+  for (size_t i = 0; i < buckets; ++i)
+    cache->buckets[i] = AES128CACHE_NONE;
+  cache->oldest = cache->newest = AES128CACHE_NONE;
+  // Seed the hash from the system so that which keys share a bucket
+  // cannot be chosen from outside
+  FILE* fp = fopen("/dev/urandom", "rb");
+  if (fp == NULL || fread(&cache->seed, sizeof(cache->seed), 1, fp) != 1)
+    cache->seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)cache;
+  if (fp != NULL) fclose(fp);
+  pthread_mutex_init(&cache->m, NULL);
+  return 1;
+}
+
+extern int aes128cache_get(aes128cache_t* cache, const uint8_t* raw,
+    aes128_key_t* key) {
+  const uint64_t hash = aes128cache_hash(cache, raw);
+  pthread_mutex_lock(&cache->m);
+  // Expand the key only if it is not already cached
+  size_t index = aes128cache_find(cache, raw, hash);
+  int hit = index != AES128CACHE_NONE;
+  if (hit) {
+    ++cache->hits; aes128cache_unlink(cache, index);
+    aes128cache_push(cache, index);
+  } else {
+    ++cache->misses; index = aes128cache_insert(cache, raw, hash);
+  }
+  // Hand out a copy, since the entry may be evicted once the lock is gone
+  *key = cache->entries[index].key;
+  pthread_mutex_unlock(&cache->m);
+  return hit;
+}
+
+#if AES128BS_AVAILABLE
+  extern int aes128cache_get_bs(aes128cache_t* cache, const uint8_t* raw,
+      aes128_key_t* key, aes128bs_key_t* bs_key) {
+    const uint64_t hash = aes128cache_hash(cache, raw);
+    pthread_mutex_lock(&cache->m);
+    size_t index = aes128cache_find(cache, raw, hash);
+    int hit = index != AES128CACHE_NONE;
+    if (hit) {
+      aes128cache_unlink(cache, index); aes128cache_push(cache, index);
+    } else
+      index = aes128cache_insert(cache, raw, hash);
+    // Slice the schedule into bit planes the first time they are needed
+    aes128cache_entry_t* entry = &cache->entries[index];
+    if (!entry->has_bs) {
+      aes128bs_key_init(&entry->key, &entry->bs_key); entry->has_bs = 1;
+      hit = 0;
+    }
+    if (hit) ++cache->hits; else ++cache->misses;
+    *key = entry->key; *bs_key = entry->bs_key;
+    pthread_mutex_unlock(&cache->m);
+    return hit;
+  }
+#endif
+
+extern void aes128cache_stats(aes128cache_t* cache,
+    aes128cache_stats_t* stats) {
+  pthread_mutex_lock(&cache->m);
+  stats->hits     = cache->hits;  stats->misses   = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->size     = cache->size;  stats->capacity = cache->capacity;
+  pthread_mutex_unlock(&cache->m);
+}
+
+extern void aes128cache_destroy(aes128cache_t* cache) {
+  // Zero-initialize every key schedule for security
+  if (cache->entries != NULL)
+    aes128cache_wipe(cache->entries,
+      cache->capacity * sizeof(*cache->entries));
+  pthread_mutex_destroy(&cache->m);
+  free(cache->entries); free(cache->buckets);
+  memset(cache, 0, sizeof(*cache));
+}
+
+uint64_t aes128cache_mix(uint64_t x) {
+  // Finalize with the SplitMix64 avalanche steps
+  x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+uint64_t aes128cache_hash(const aes128cache_t* cache, const uint8_t* raw) {
+  uint64_t lo, hi;
+  memcpy(&lo, raw, sizeof(lo)); memcpy(&hi, raw + 8, sizeof(hi));
+  return aes128cache_mix(aes128cache_mix(lo ^ cache->seed) ^ hi);
+}
+
+size_t aes128cache_find(aes128cache_t* cache, const uint8_t* raw,
+    uint64_t hash) {
+  // Walk the bucket's chain, comparing full keys only on a hash match
+  for (size_t i = cache->buckets[hash & cache->mask];
+      i != AES128CACHE_NONE; i = cache->entries[i].chain)
+    if (cache->entries[i].hash == hash &&
+        memcmp(cache->entries[i].raw, raw, 16) == 0)
+      return i;
+  return AES128CACHE_NONE;
+}
+
+size_t aes128cache_insert(aes128cache_t* cache, const uint8_t* raw,
+    uint64_t hash) {
+  size_t index = cache->size;
+  if (cache->size < cache->capacity)
+    ++cache->size;
+  else {
+    // Reuse the least recently used entry, dropping it from its bucket
+    index = cache->oldest;
+    size_t* link = &cache->buckets[cache->entries[index].hash & cache->mask];
+    while (*link != index) link = &cache->entries[*link].chain;
+    *link = cache->entries[index].chain;
+    aes128cache_unlink(cache, index);
+    aes128cache_wipe(&cache->entries[index], sizeof(cache->entries[index]));
+    ++cache->evictions;
+  }
+  // Expand the new key in place and make it the most recently used
+  aes128cache_entry_t* entry = &cache->entries[index];
+  memcpy(entry->raw, raw, 16); memcpy(entry->key.val, raw, 16);
+  aes128_key_init(&entry->key);
+  entry->hash  = hash;
+  entry->chain = cache->buckets[hash & cache->mask];
+  cache->buckets[hash & cache->mask] = index;
+  aes128cache_push(cache, index);
+  return index;
+}
+
+void aes128cache_unlink(aes128cache_t* cache, size_t index) {
+  aes128cache_entry_t* entry = &cache->entries[index];
+  if (entry->older != AES128CACHE_NONE)
+    cache->entries[entry->older].newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+  if (entry->newer != AES128CACHE_NONE)
+    cache->entries[entry->newer].older = entry->older;
+  else
+    cache->newest = entry->older;
+}
+
+void aes128cache_push(aes128cache_t* cache, size_t index) {
+  aes128cache_entry_t* entry = &cache->entries[index];
+  entry->older = cache->newest; entry->newer = AES128CACHE_NONE;
+  if (cache->newest != AES128CACHE_NONE)
+    cache->entries[cache->newest].newer = index;
+  else
+    cache->oldest = index;
+  cache->newest = index;
+}
+
+void aes128cache_wipe(void* data, size_t size) {
+  // Write through a volatile pointer so that the stores are never elided
+  volatile uint8_t* bytes = (volatile uint8_t*)data;
+  for (size_t i = 0; i < size; ++i) bytes[i] = 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128CACHE_H
+#define __AES128CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128bs.h"
+
+// Number of schedules kept when no capacity is given
+#define AES128CACHE_CAPACITY 4096
+
+// Marks the end of a bucket chain or of the recency list
+#define AES128CACHE_NONE SIZE_MAX
+
+// One raw key and the schedules expanded from it; entries are linked into
+// their hash bucket and into the recency list by index
+typedef struct {
+  uint8_t                raw[16];
+  uint64_t               hash;
+  aes128_key_t           key;
+  #if AES128BS_AVAILABLE
+    // Bit planes for the bitsliced engine, filled in on first request
+    aes128bs_key_t       bs_key;
+    int                  has_bs;
+  #endif
+  size_t                 chain, older, newer;
+} aes128cache_entry_t;
+
+typedef struct {
+  uint64_t               hits, misses, evictions;
+  size_t                 size, capacity;
+} aes128cache_stats_t;
+
+// A bounded, thread-safe map from raw keys to their expanded schedules that
+// evicts the least recently used entry once full
+typedef struct {
+  pthread_mutex_t        m;
+  aes128cache_entry_t*   entries;
+  size_t*                buckets;
+  size_t                 capacity, mask, size, oldest, newest;
+  uint64_t               seed, hits, misses, evictions;
+} aes128cache_t;
+
+extern int aes128cache_init(aes128cache_t* cache, size_t capacity);
+extern int aes128cache_get(aes128cache_t* cache, const uint8_t* raw,
+  aes128_key_t* key);
+#if AES128BS_AVAILABLE
+  extern int aes128cache_get_bs(aes128cache_t* cache, const uint8_t* raw,
+    aes128_key_t* key, aes128bs_key_t* bs_key);
+#endif
+extern void aes128cache_stats(aes128cache_t* cache,
+  aes128cache_stats_t* stats);
+extern void aes128cache_destroy(aes128cache_t* cache);
+
+#endif
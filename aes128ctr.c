@@ -17,26 +17,108 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "aes.h"
 #include "aes128.h"
+#include "aes128bs.h"
 #include "aes128ctr.h"
+#include "aes128ni.h"
+#include "aes128pool.h"
+#include "aes128sched.h"
+#include "aes128trace.h"
+#include "aes128uring.h"
 
 #ifdef __APPLE__
 #define lseek64 lseek
 #define open64  open
 #endif
 
+void aes128ctr_config_env(const char* name, size_t* value, size_t max);
 void aes128ctr_get_key(const aes128_nonce_t* nonce, const aes128_key_t* key,
   uint64_t counter, aes128_state_t* state);
+void* aes128ctr_buffer_target(void* arg);
+void aes128ctr_crypt_lanes(const aes128_key_t* const* keys,
+  const aes128_nonce_t* const* nonces, const uint64_t* counters,
+  uint8_t* const* blocks, size_t lanes);
 void* aes128ctr_pthread_target(void* arg);
+void* aes128ctr_reader_target(void* arg);
+void* aes128ctr_mmap_target(void* arg);
+size_t aes128ctr_pread_full(int fd, void* buf, size_t length, off_t offset);
+size_t aes128ctr_read_full(int fd, void* buf, size_t length, int* error);
+size_t aes128ctr_pread_run(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, int fd, int out_fd, int tail_fd, size_t align,
+  int nocache, uint64_t offset, uint64_t length,
+  const aes128ctr_config_t* config, aes128ctr_stats_t* stats);
+void* aes128ctr_pread_target(void* arg);
+void aes128ctr_pread_chunks(aes128ctr_worker_t* worker);
+size_t aes128ctr_pwrite_full(int fd, const void* buf, size_t length,
+  off_t offset);
+double aes128ctr_now(void);
+void aes128ctr_lap(double* mark, double* seconds);
+void aes128ctr_stats_start(aes128ctr_stats_t* stats, size_t threads);
+aes128ctr_thread_stats_t* aes128ctr_stats_worker(aes128ctr_stats_t* stats,
+  size_t tid);
+void aes128ctr_stats_finish(aes128ctr_stats_t* stats, double start);
+void aes128ctr_ctx_nonce(aes128ctr_ctx_t* ctx, aes128_nonce_t* nonce);
+size_t aes128ctr_ctx_run(aes128ctr_ctx_t* ctx, uint64_t length,
+  size_t chunk, int local);
+size_t aes128ctr_ctx_run_file(aes128ctr_ctx_t* ctx, int fd, uint64_t size);
+int aes128ctr_ctx_file(aes128ctr_worker_t* worker,
+  aes128ctr_batch_file_t* file);
+void* aes128ctr_ctx_target(void* arg);
+int aes128ctr_batch_compare(const void* a, const void* b);
+void* aes128ctr_stream_target(void* arg);
+void* aes128ctr_stream_writer(void* arg);
+void aes128ctr_ctx_chunks(aes128ctr_worker_t* worker);
+
+extern void aes128ctr_config_init(aes128ctr_config_t* config) {
+  // Default to one worker per online processor
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  config->threads   = cpus > 0 ? (size_t)cpus : 1;
+  config->blocks    = AES128CTR_WORKER_BLOCK_COUNT;
+  config->depth     = AES128URING_DEPTH;
+  config->threshold = AES128CTR_THRESHOLD;
+  // Size chunks so that a worker's two slots take at most half of its L2
+  // cache, leaving the rest for the key stream and the key schedule
+  #ifdef _SC_LEVEL2_CACHE_SIZE
+    long cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache > 0) {
+      config->blocks = AES128CTR_MIN_BLOCK_COUNT;
+      while (config->blocks < AES128CTR_MAX_BLOCK_COUNT &&
+          (config->blocks << 7) <= (size_t)cache)
+        config->blocks <<= 1;
+    }
+  #endif
+  // Let the environment override any of the defaults
+  aes128ctr_config_env("AES128CTR_THREADS",   &config->threads,   SIZE_MAX);
+  aes128ctr_config_env("AES128CTR_BLOCKS",    &config->blocks,    SIZE_MAX);
+  aes128ctr_config_env("AES128CTR_DEPTH",     &config->depth,
+    AES128URING_MAX_DEPTH);
+  aes128ctr_config_env("AES128CTR_THRESHOLD", &config->threshold, SIZE_MAX);
+}
+
+void aes128ctr_config_env(const char* name, size_t* value, size_t max) {
+  const char* text = getenv(name); char* end = NULL;
+  if (text == NULL || *text == 0) return;
+  // Ignore anything that is not a positive integer, and clamp the rest
+  unsigned long long parsed = strtoull(text, &end, 10);
+  if (*end == 0 && parsed > 0)
+    *value = parsed < max ? (size_t)parsed : max;
+}
 
 void aes128ctr_get_key(const aes128_nonce_t* nonce,
     const aes128_key_t* key, uint64_t counter, aes128_state_t* state) {
@@ -45,28 +127,8 @@ void aes128ctr_get_key(const aes128_nonce_t* nonce,
   // Copy the corresponding nonce and counter into the input
   memcpy(state->val,                      nonce->val, sizeof(nonce->val));
   memcpy(state->val + sizeof(nonce->val), &counter, sizeof(counter));
-  #if (DEBUG > 1)
-    pthread_mutex_lock(&io);
-    fprintf(stderr, "[AES] KEY  : ");
-    for (size_t i = 0; i < 16; ++i)
-      fprintf(stderr, "%s%02x", i > 0 ? " " : "", key->val[i]);
-    fprintf(stderr, "\n");
-    fprintf(stderr, "[AES] STATE: ");
-    for (size_t i = 0; i < 16; ++i)
-      fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-    fprintf(stderr, "\n");
-    pthread_mutex_unlock(&io);
-  #endif
   // Crypt the input to generate a key stream for this block
   aes128_encrypt(key, state);
-  #if (DEBUG > 1)
-    pthread_mutex_lock(&io);
-    fprintf(stderr, "[AES] ENCPT: ");
-    for (size_t i = 0; i < 16; ++i)
-      fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-    fprintf(stderr, "\n\n");
-    pthread_mutex_unlock(&io);
-  #endif
 }
 
 extern void aes128ctr_crypt(const aes128_nonce_t* nonce,
@@ -74,25 +136,327 @@ extern void aes128ctr_crypt(const aes128_nonce_t* nonce,
   // Fetch the key stream for this counter
   aes128_state_t    key_stream;
   aes128ctr_get_key(nonce, key, counter, &key_stream);
-  #if (DEBUG > 1)
-    pthread_mutex_lock(&io);
-    fprintf(stderr, "[AES] BEFOR: ");
-    for (size_t i = 0; i < 16; ++i)
-      fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-    fprintf(stderr, "\n");
-    pthread_mutex_unlock(&io);
-  #endif
   // XOR the state with the key stream
   for (uint8_t i = 0; i < sizeof(state->val); ++i)
     state->val[i] ^= key_stream.val[i];
-  #if (DEBUG > 1)
-    pthread_mutex_lock(&io);
-    fprintf(stderr, "[AES] AFTER: ");
-    for (size_t i = 0; i < 16; ++i)
-      fprintf(stderr, "%s%02x", i > 0 ? " " : "", state->val[i]);
-    fprintf(stderr, "\n\n");
-    pthread_mutex_unlock(&io);
+}
+
+extern void aes128ctr_keystream(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+    size_t blocks) {
+  // Generate the key stream for a run of consecutive counters at once
+  switch (aes128_engine()) {
+    #if AES128NI_AVAILABLE
+      case AES128_ENGINE_VAES:
+        aes128ni_ctr_keystream_vaes(nonce, key, counter, out, blocks); break;
+      case AES128_ENGINE_AESNI:
+        aes128ni_ctr_keystream(nonce, key, counter, out, blocks);      break;
+    #endif
+    #if AES128BS_AVAILABLE
+      case AES128_ENGINE_BITSLICE:
+        aes128bs_ctr_keystream(nonce, key, counter, out, blocks);      break;
+    #endif
+    default:
+      aes128_ctr_keystream(nonce, key, counter, out, blocks);          break;
+  }
+}
+
+extern void aes128ctr_crypt_blocks(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* state,
+    size_t blocks) {
+  aes128_state_t key_stream[AES128CTR_STREAM_BLOCKS];
+  while (blocks > 0) {
+    size_t count = blocks < AES128CTR_STREAM_BLOCKS ?
+      blocks : AES128CTR_STREAM_BLOCKS;
+    // Fetch the key stream for this batch while it still fits in L1
+    aes128ctr_keystream(nonce, key, counter, key_stream, count);
+    // XOR the state with the key stream
+    for (size_t i = 0; i < count; ++i)
+      for (uint8_t j = 0; j < sizeof(state->val); ++j)
+        state[i].val[j] ^= key_stream[i].val[j];
+    state += count; counter += count; blocks -= count;
+  }
+}
+
+extern void aes128ctr_crypt_buffer(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, const void* in, void* out,
+    size_t length) {
+  aes128_state_t key_stream[AES128CTR_STREAM_BLOCKS];
+  const uint8_t* src = (const uint8_t*)in; uint8_t* dst = (uint8_t*)out;
+  while (length > 0) {
+    size_t bytes = length < sizeof(key_stream) ? length : sizeof(key_stream);
+    size_t count = (bytes + 15) >> 4;
+    // Fetch the key stream for this batch, including a partial last block
+    aes128ctr_keystream(nonce, key, counter, key_stream, count);
+    // XOR straight from the input into the output; they may be the same
+    const uint8_t* stream = key_stream[0].val;
+    for (size_t i = 0; i < bytes; ++i)
+      dst[i] = src[i] ^ stream[i];
+    src += bytes; dst += bytes; counter += count; length -= bytes;
+  }
+}
+
+extern void aes128ctr_crypt_inplace(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, void* data, size_t length) {
+  aes128ctr_crypt_buffer(nonce, key, counter, data, data, length);
+}
+
+extern void aes128ctr_crypt_messages(aes128ctr_message_t* messages,
+    size_t count) {
+  const aes128_key_t* keys[AES128CTR_MESSAGE_LANES];
+  const aes128_nonce_t* nonces[AES128CTR_MESSAGE_LANES];
+  uint64_t counters[AES128CTR_MESSAGE_LANES];
+  uint8_t* blocks[AES128CTR_MESSAGE_LANES];
+  aes128_state_t tail[AES128CTR_MESSAGE_LANES];
+  uint8_t* tail_data[AES128CTR_MESSAGE_LANES];
+  size_t tail_length[AES128CTR_MESSAGE_LANES];
+  for (size_t i = 0, done = 0;;) {
+    size_t lanes = 0, tails = 0;
+    // Deal out the next blocks of the short messages, one per lane, so that
+    // blocks under different keys are crypted side by side
+    while (lanes < AES128CTR_MESSAGE_LANES && i < count) {
+      aes128ctr_message_t* m = &messages[i];
+      // Long messages go through the single-stream path, which keeps the
+      // engine busy by itself
+      if (done == 0 && m->length >= AES128CTR_MESSAGE_LONG)
+        aes128ctr_crypt_inplace(m->nonce, m->key, m->counter, m->data,
+          m->length);
+      if (done == 0 && (m->length >= AES128CTR_MESSAGE_LONG ||
+          m->length == 0)) {
+        ++i; continue;
+      }
+      keys[lanes]     = m->key;     nonces[lanes] = m->nonce;
+      counters[lanes] = m->counter + (done >> 4);
+      blocks[lanes]   = m->data + done;
+      // A partial last block is crypted in a scratch block and copied back
+      if (m->length - done < 16) {
+        tail_data[tails] = blocks[lanes]; tail_length[tails] = m->length - done;
+        memset(tail[tails].val, 0, sizeof(tail[tails].val));
+        memcpy(tail[tails].val, blocks[lanes], tail_length[tails]);
+        blocks[lanes] = tail[tails++].val;
+      }
+      ++lanes;
+      if ((done += 16) >= m->length) {
+        ++i; done = 0;
+      }
+    }
+    if (lanes == 0) break;
+    aes128ctr_crypt_lanes(keys, nonces, counters, blocks, lanes);
+    for (size_t j = 0; j < tails; ++j)
+      memcpy(tail_data[j], tail[j].val, tail_length[j]);
+  }
+}
+
+void aes128ctr_crypt_lanes(const aes128_key_t* const* keys,
+    const aes128_nonce_t* const* nonces, const uint64_t* counters,
+    uint8_t* const* blocks, size_t lanes) {
+  switch (aes128_engine()) {
+    #if AES128NI_AVAILABLE
+      // Interleave the lanes' rounds so that their AESENCs overlap
+      case AES128_ENGINE_VAES:
+      case AES128_ENGINE_AESNI:
+        aes128ni_ctr_crypt_lanes(keys, nonces, counters, blocks, lanes);
+        return;
+    #endif
+    #if AES128BS_AVAILABLE
+      // Transpose every lane's own round keys alongside its block
+      case AES128_ENGINE_BITSLICE:
+        aes128bs_ctr_crypt_lanes(keys, nonces, counters, blocks, lanes);
+        return;
+    #endif
+    default: break;
+  }
+  // Otherwise interleave the lanes through the table rounds
+  aes128_ctr_crypt_lanes(keys, nonces, counters, blocks, lanes);
+}
+
+extern void aes128ctr_crypt_range(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t offset, const void* in, void* out,
+    size_t length) {
+  const uint8_t* src = (const uint8_t*)in; uint8_t* dst = (uint8_t*)out;
+  // A start inside a block uses only the tail of that block's key stream
+  if ((offset & 15) != 0 && length > 0) {
+    aes128_state_t key_stream; size_t skip = (size_t)(offset & 15);
+    size_t bytes = 16 - skip < length ? 16 - skip : length;
+    aes128ctr_keystream(nonce, key, offset >> 4, &key_stream, 1);
+    for (size_t i = 0; i < bytes; ++i)
+      dst[i] = src[i] ^ key_stream.val[skip + i];
+    src += bytes; dst += bytes; offset += bytes; length -= bytes;
+  }
+  // The rest starts on a block boundary; a partial last block is handled
+  // by the buffer path
+  aes128ctr_crypt_buffer(nonce, key, offset >> 4, src, dst, length);
+}
+
+extern void aes128ctr_crypt_buffer_parallel(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, const void* in, void* out,
+    size_t length, const aes128ctr_config_t* config) {
+  // Small buffers are cheaper to crypt than to hand to other threads
+  size_t threads = config == NULL || length < config->threshold ?
+    1 : config->threads;
+  aes128ctr_buffer_worker_t* workers = threads > 1 ?
+    calloc(threads, sizeof(*workers)) : NULL;
+  if (workers == NULL) {
+    aes128ctr_crypt_buffer(nonce, key, counter, in, out, length);
+    return;
+  }
+  // Split the buffer into one block-aligned slice per thread
+  size_t slice = ((length + threads - 1) / threads + 15) & ~(size_t)15;
+  for (size_t i = 0, offset = 0; i < threads; ++i, offset += slice) {
+    workers[i].nonce   = nonce;   workers[i].key = key;
+    workers[i].counter = counter + (offset >> 4);
+    workers[i].in      = (const uint8_t*)in + offset;
+    workers[i].out     = (uint8_t*)out + offset;
+    workers[i].length  = offset >= length ? 0 :
+      length - offset < slice ? length - offset : slice;
+  }
+  // Crypt the first slice on this thread while the others run
+  for (size_t i = 1; i < threads; ++i)
+    workers[i].started = pthread_create(&workers[i].thread, NULL,
+      aes128ctr_buffer_target, &workers[i]) == 0;
+  aes128ctr_buffer_target(&workers[0]);
+  // A slice whose thread could not be started is crypted here instead
+  for (size_t i = 1; i < threads; ++i)
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+    else aes128ctr_buffer_target(&workers[i]);
+  free(workers);
+}
+
+void* aes128ctr_buffer_target(void* arg) {
+  aes128ctr_buffer_worker_t* worker = (aes128ctr_buffer_worker_t*)arg;
+  aes128ctr_crypt_buffer(worker->nonce, worker->key, worker->counter,
+    worker->in, worker->out, worker->length);
+  return NULL;
+}
+
+extern int aes128ctr_crypt_stream(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, int in_fd, int out_fd,
+    const aes128ctr_config_t* config, uint64_t* bytes) {
+  const size_t threads = config->threads, chunk = config->blocks << 4;
+  aes128ctr_stream_t stream; aes128pool_t pool; pthread_t writer;
+  // Keep every worker's slots busy plus one chunk each being read and
+  // written; memory use is fixed however long the stream runs
+  memset(&stream, 0, sizeof(stream));
+  stream.nonce  = nonce;   stream.key   = key;
+  stream.out_fd = out_fd;  stream.count = AES128CTR_WORKER_SLOTS * threads + 2;
+  stream.slots  = calloc(stream.count, sizeof(*stream.slots));
+  pthread_t* workers = calloc(threads, sizeof(*workers));
+  if (stream.slots == NULL || workers == NULL ||
+      !aes128pool_init(&pool, stream.count, chunk)) {
+    free(stream.slots); free(workers); return 0;
+  }
+  for (size_t i = 0; i < stream.count; ++i)
+    stream.slots[i].data = (uint8_t*)aes128pool_buffer(&pool, i);
+  // Let pipes carry a whole chunk per transfer where the kernel allows it
+  #ifdef F_SETPIPE_SZ
+    fcntl(in_fd,  F_SETPIPE_SZ, (int)chunk);
+    fcntl(out_fd, F_SETPIPE_SZ, (int)chunk);
   #endif
+  pthread_mutex_init(&stream.m, NULL); pthread_cond_init(&stream.c, NULL);
+  // Run with as many workers as could be started, but fail the stream if
+  // nothing would be left to crypt or write the ring
+  size_t started = 0;
+  while (started < threads && pthread_create(&workers[started], NULL,
+      aes128ctr_stream_target, &stream) == 0)
+    ++started;
+  int writing = started > 0 &&
+    pthread_create(&writer, NULL, aes128ctr_stream_writer, &stream) == 0;
+  if (!writing) {
+    pthread_mutex_lock(&stream.m);
+    stream.failed = 1; pthread_cond_broadcast(&stream.c);
+    pthread_mutex_unlock(&stream.m);
+  }
+  aes128trace_name("reader");
+  // Read the stream on this thread, one whole chunk at a time so that only
+  // the final chunk can end in a partial block
+  for (size_t n = 0; ; ++n) {
+    aes128ctr_stream_slot_t* slot = &stream.slots[n % stream.count];
+    pthread_mutex_lock(&stream.m);
+    while (n - stream.written >= stream.count && !stream.failed)
+      pthread_cond_wait(&stream.c, &stream.m);
+    int failed = stream.failed;
+    pthread_mutex_unlock(&stream.m);
+    if (failed) break;
+    int error = 0;
+    size_t length = aes128ctr_read_full(in_fd, slot->data, chunk, &error);
+    pthread_mutex_lock(&stream.m);
+    if (length > 0) {
+      slot->status  = AES128CTR_SLOT_FILLED;
+      slot->counter = (uint64_t)n * config->blocks;
+      slot->length  = length; ++stream.filled;
+      aes128trace(AES128TRACE_DISPATCH, slot->counter << 4, length);
+    }
+    if (length < chunk) stream.eof = 1;
+    if (error) stream.failed = 1;
+    pthread_cond_broadcast(&stream.c);
+    pthread_mutex_unlock(&stream.m);
+    if (length < chunk) break;
+  }
+  // Every thread drains what was read and exits once the ring is empty
+  for (size_t i = 0; i < started; ++i)
+    pthread_join(workers[i], NULL);
+  if (writing) pthread_join(writer, NULL);
+  *bytes = stream.bytes; int ok = !stream.failed;
+  pthread_cond_destroy(&stream.c); pthread_mutex_destroy(&stream.m);
+  aes128pool_destroy(&pool); free(stream.slots); free(workers);
+  return ok;
+}
+
+void* aes128ctr_stream_target(void* arg) {
+  aes128ctr_stream_t* stream = (aes128ctr_stream_t*)arg;
+  aes128trace_name("worker");
+  pthread_mutex_lock(&stream->m);
+  for (;;) {
+    // Claim the oldest chunk that has been read but not yet crypted
+    while (stream->claimed == stream->filled && !stream->eof &&
+        !stream->failed)
+      pthread_cond_wait(&stream->c, &stream->m);
+    if (stream->claimed == stream->filled || stream->failed) break;
+    aes128ctr_stream_slot_t* slot =
+      &stream->slots[stream->claimed++ % stream->count];
+    pthread_mutex_unlock(&stream->m);
+    aes128trace(AES128TRACE_START,  slot->counter << 4, slot->length);
+    aes128ctr_crypt_inplace(stream->nonce, stream->key, slot->counter,
+      slot->data, slot->length);
+    aes128trace(AES128TRACE_FINISH, slot->counter << 4, slot->length);
+    pthread_mutex_lock(&stream->m);
+    slot->status = AES128CTR_SLOT_CRYPTED;
+    pthread_cond_broadcast(&stream->c);
+  }
+  pthread_mutex_unlock(&stream->m);
+  return NULL;
+}
+
+void* aes128ctr_stream_writer(void* arg) {
+  aes128ctr_stream_t* stream = (aes128ctr_stream_t*)arg;
+  aes128trace_name("writer");
+  for (size_t n = 0; ; ++n) {
+    aes128ctr_stream_slot_t* slot = &stream->slots[n % stream->count];
+    // Write chunks strictly in stream order as they become ready
+    pthread_mutex_lock(&stream->m);
+    while (!stream->failed && (n < stream->filled ?
+        slot->status != AES128CTR_SLOT_CRYPTED : !stream->eof))
+      pthread_cond_wait(&stream->c, &stream->m);
+    int done = stream->failed || n >= stream->filled;
+    pthread_mutex_unlock(&stream->m);
+    if (done) break;
+    size_t written = 0;
+    while (written < slot->length) {
+      ssize_t count = write(stream->out_fd, slot->data + written,
+        slot->length - written);
+      if (count < 0 && errno == EINTR) continue;
+      if (count <= 0) break;
+      written += (size_t)count;
+    }
+    aes128trace(AES128TRACE_FLUSH, slot->counter << 4, written);
+    // Hand the slot back to the reader
+    pthread_mutex_lock(&stream->m);
+    if (written < slot->length) stream->failed = 1;
+    slot->status = AES128CTR_SLOT_EMPTY; stream->bytes += written;
+    ++stream->written; pthread_cond_broadcast(&stream->c);
+    pthread_mutex_unlock(&stream->m);
+  } return NULL;
 }
 
 extern size_t aes128ctr_crypt_block_file(const aes128_nonce_t* nonce,
@@ -108,185 +472,908 @@ extern size_t aes128ctr_crypt_block_file(const aes128_nonce_t* nonce,
 
 extern size_t aes128ctr_crypt_path(const aes128_nonce_t* nonce,
     const aes128_key_t* key, const char* path) {
+  aes128_state_t buffer[AES128CTR_STREAM_BLOCKS << 4];
   // Open two files; one for read, one for write
   FILE* ifp = fopen(path, "rb"); FILE* ofp = fopen(path, "r+b");
-  // Set the buffer size for the file to increase throughput
-  setvbuf(ifp, NULL, _IOFBF, 1 << 12);
-  setvbuf(ofp, NULL, _IOFBF, 1 << 12);
-  // Iterate over each chunk to encrypt its blocks
-  for (uint64_t counter = 0, result = 16; result == 16; ++counter)
-    result = aes128ctr_crypt_block_file(nonce, key, ifp, ofp, counter);
+  if (ifp == NULL || ofp == NULL) {
+    if (ifp != NULL) fclose(ifp);
+    if (ofp != NULL) fclose(ofp);
+    return 0;
+  }
+  // Crypt a buffer at a time through the batched key stream of the active
+  // engine, rather than one block per call
+  for (uint64_t offset = 0;;) {
+    size_t bytes = fread(buffer, 1, sizeof(buffer), ifp);
+    if (bytes == 0) break;
+    aes128ctr_crypt_range(nonce, key, offset, buffer, buffer, bytes);
+    if (fwrite(buffer, 1, bytes, ofp) < bytes) break;
+    offset += bytes;
+  }
   // Return the current position of the output stream
   size_t size = ftell(ofp); fclose(ifp); fclose(ofp);
   return size;
 }
 
 extern size_t aes128ctr_crypt_path_pthread(const aes128_nonce_t* nonce,
-    const aes128_key_t* key, const char* path, const size_t threads) {
-  // Create a pool of workers to process data
-  aes128ctr_worker_t workers[threads];
-  memset(workers, 0, sizeof(workers));
+    const aes128_key_t* key, const char* path,
+    const aes128ctr_config_t* config, aes128ctr_stats_t* stats) {
+  const size_t threads = config->threads, chunk = config->blocks << 4;
+  const double start = aes128ctr_now();
+  aes128ctr_thread_stats_t* writer = stats != NULL ? &stats->writer : NULL;
+  aes128ctr_stats_start(stats, threads);
   // Open two files; one for read, one for write
   FILE* ifp = fopen(path, "rb"); FILE* ofp = fopen(path, "r+b");
+  if (ifp == NULL || ofp == NULL) {
+    if (ifp != NULL) fclose(ifp);
+    if (ofp != NULL) fclose(ofp);
+    return 0;
+  }
   // Set the buffer size for the file to increase throughput
-  setvbuf(ifp, NULL, _IOFBF, threads * (AES128CTR_WORKER_BLOCK_COUNT << 4));
-  setvbuf(ofp, NULL, _IOFBF, threads * (AES128CTR_WORKER_BLOCK_COUNT << 4));
-  // Iterate over each thread to prepare it for launch
+  setvbuf(ifp, NULL, _IOFBF, threads * chunk);
+  setvbuf(ofp, NULL, _IOFBF, threads * chunk);
+  // Both streams sweep the file once from front to back
+  posix_fadvise(fileno(ifp), 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fileno(ofp), 0, 0, POSIX_FADV_SEQUENTIAL);
+  // Keep every worker's slots busy plus one chunk each being read and
+  // written, in page-aligned buffers from a shared pool
+  aes128pool_t pool;
+  aes128ctr_pipeline_t pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.ifp   = ifp;   pipeline.blocks = config->blocks;
+  pipeline.stats = stats != NULL ? &stats->reader : NULL;
+  pipeline.count = AES128CTR_WORKER_SLOTS * threads + 2;
+  pipeline.slots = calloc(pipeline.count, sizeof(*pipeline.slots));
+  aes128ctr_worker_t* workers = calloc(threads, sizeof(*workers));
+  if (pipeline.slots == NULL || workers == NULL ||
+      !aes128pool_init(&pool, pipeline.count, chunk)) {
+    free(pipeline.slots); free(workers); fclose(ifp); fclose(ofp); return 0;
+  }
+  // Initialize the buffer, mutex and condition of each slot
+  for (size_t i = 0; i < pipeline.count; ++i) {
+    pipeline.slots[i].state = aes128pool_buffer(&pool, i);
+    pthread_mutex_init(&pipeline.slots[i].m, NULL);
+    pthread_cond_init (&pipeline.slots[i].c, NULL);
+  }
+  pthread_mutex_init(&pipeline.m, NULL); pthread_cond_init(&pipeline.c, NULL);
   for (size_t i = 0; i < threads; ++i) {
     // Provide this thread its index in the worker pool
-    workers[i].tid   = i;
+    workers[i].tid   = i;       workers[i].threads = threads;
     // Assign the nonce and key pointers for this worker
-    workers[i].nonce = nonce; workers[i].key = key;
-    // Initialize the mutexes and conditions for this worker
-    pthread_mutex_init(&workers[i].mi, NULL);
-    pthread_mutex_init(&workers[i].mo, NULL);
-    pthread_cond_init (&workers[i].ci, NULL);
-    pthread_cond_init (&workers[i].co, NULL);
-    // Launch this thread by calling pthread_create()
-    pthread_create(&workers[i].thread, NULL,
-      aes128ctr_pthread_target, &workers[i]);
-  }
-  // Continue reading until error or EOF
-  uint64_t counter = 0;
-  while (!feof(ifp) && !ferror(ifp) && !ferror(ofp)) {
-    #if DEBUG
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[MAIN] Loop start.\n");
-      pthread_mutex_unlock(&io);
-    #endif
-    // Prepare each thread for data processing
-    for (size_t i = 0; !feof(ifp) && !ferror(ifp) && i < threads; ++i) {
-      pthread_mutex_lock(&workers[i].mi);
-      #if DEBUG
-        pthread_mutex_lock(&io);
-        fprintf(stderr, "[MAIN] Loading data for Thread %lu ...\n", i);
-        pthread_mutex_unlock(&io);
-      #endif
-      // Attempt to read as many blocks for this worker as specified
-      workers[i].length = (workers[i].blocks = fread(workers[i].state,
-        16, AES128CTR_WORKER_BLOCK_COUNT, ifp)) << 4;
-      // Check to see that the requested number of blocks could not be read
-      if (workers[i].blocks < AES128CTR_WORKER_BLOCK_COUNT) {
-        fseek(ifp, (counter << 4) + workers[i].length, SEEK_SET);
-        // Attempt to read a partial block into the next block
-        size_t bytes = fread(&workers[i].state[workers[i].blocks], 1, 16, ifp);
-        // If we read non-zero bytes, then increment the block count and length
-        if (bytes > 0) {
-          ++workers[i].blocks; workers[i].length += bytes;
-          #if DEBUG
-            pthread_mutex_lock(&io);
-            fprintf(stderr, "[MAIN] Partial data for Thread %lu.\n", i);
-            pthread_mutex_unlock(&io);
-          #endif
-        }
-      }
-      // Set the offset of the worker and increment the counter
-      workers[i].offset = counter; counter += workers[i].blocks;
-      // Signal the thread to begin processing data (if available)
-      if (workers[i].blocks > 0) {
-        #if DEBUG
-          pthread_mutex_lock(&io);
-          fprintf(stderr, "[MAIN] Signaling input for Thread %lu ...\n", i);
-          pthread_mutex_unlock(&io);
-        #endif
-        workers[i].vi = 1; pthread_cond_signal(&workers[i].ci);
-      }
-      #if DEBUG
-        pthread_mutex_lock(&io);
-        fprintf(stderr, "[MAIN] Done loading data (%lu blocks / %lu B) for "
-          "Thread %lu ...\n", workers[i].blocks, workers[i].length, i);
-        pthread_mutex_unlock(&io);
-      #endif
-      pthread_mutex_unlock(&workers[i].mi);
-    }
-    // Flush each thread's data to disk after it is finished processing
-    for (size_t i = 0, stop = 0; !stop && !ferror(ofp) && i < threads; ++i) {
-      // Wait for this thread to finish processing data
-      pthread_mutex_lock(&workers[i].mo);
-      // Ensure that this worker has data to be processed
-      if (workers[i].length > 0) {
-        #if DEBUG
-          pthread_mutex_lock(&io);
-          fprintf(stderr, "[MAIN] Writing %lu blocks for Thread %lu ...\n",
-            workers[i].blocks, i);
-          pthread_mutex_unlock(&io);
-        #endif
-        while(!workers[i].vo) pthread_cond_wait(&workers[i].co, &workers[i].mo);
-        workers[i].vo = 0; pthread_cond_signal(&workers[i].co);
-        // Flush this worker's data to disk
-        size_t bytes = fwrite(workers[i].state, 1, workers[i].length, ofp);
-        stop = bytes < workers[i].length;
-        // Release the mutex to allow further processing of data
-        #if DEBUG
-          pthread_mutex_lock(&io);
-          fprintf(stderr, "[MAIN] Done writing data for Thread %lu ...\n", i);
-          pthread_mutex_unlock(&io);
-        #endif
-      }
-      workers[i].blocks = workers[i].length = 0;
-      pthread_mutex_unlock(&workers[i].mo);
+    workers[i].nonce = nonce;   workers[i].key     = key;
+    workers[i].stats = aes128ctr_stats_worker(stats, i);
+    workers[i].pipeline = &pipeline;
+  }
+  // Run with as many workers as could be started; any of them can take
+  // any chunk, so none is left waiting on a missing one
+  size_t started = 0;
+  while (started < threads && pthread_create(&workers[started].thread, NULL,
+      aes128ctr_pthread_target, &workers[started]) == 0)
+    ++started;
+  // Start reading ahead on a separate thread
+  int reading = started > 0 && pthread_create(&pipeline.reader, NULL,
+    aes128ctr_reader_target, &pipeline) == 0;
+  aes128trace_name("writer");
+  // Flush chunks in counter order while later chunks are read and crypted
+  double mark = start;
+  for (size_t n = 0, failed = !reading; !failed; ++n) {
+    aes128ctr_slot_t* slot = &pipeline.slots[n % pipeline.count];
+    pthread_mutex_lock(&slot->m);
+    while (slot->status != AES128CTR_SLOT_CRYPTED)
+      pthread_cond_wait(&slot->c, &slot->m);
+    pthread_mutex_unlock(&slot->m);
+    if (writer != NULL) aes128ctr_lap(&mark, &writer->wait_seconds);
+    // An empty chunk marks the end of the input
+    if (slot->length == 0) break;
+    failed = fwrite(slot->state, 1, slot->length, ofp) < slot->length;
+    aes128trace(AES128TRACE_FLUSH, slot->offset << 4, slot->length);
+    if (writer != NULL) {
+      aes128ctr_lap(&mark, &writer->write_seconds);
+      ++writer->chunks; writer->write_bytes += slot->length;
     }
-    #if DEBUG
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[MAIN] Loop end.\n");
-      pthread_mutex_unlock(&io);
-    #endif
+    // Hand the slot back to the reader
+    pthread_mutex_lock(&slot->m);
+    slot->status = AES128CTR_SLOT_EMPTY; pthread_cond_broadcast(&slot->c);
+    pthread_mutex_unlock(&slot->m);
   }
-  #if DEBUG
-    pthread_mutex_lock(&io);
-    fprintf(stderr, "[MAIN] Stopping all threads ...\n");
-    pthread_mutex_unlock(&io);
-  #endif
-  // Mark each thread to stop, then wake it up and wait for it to exit
-  for (size_t i = 0; i < threads; ++i) {
-    pthread_mutex_lock(&workers[i].mi);
-    workers[i].stop = 1; pthread_cond_signal(&workers[i].ci);
-    pthread_mutex_unlock(&workers[i].mi);
+  // Mark the pipeline as stopped and wake every thread that may be waiting
+  pthread_mutex_lock(&pipeline.m);
+  pipeline.stop = 1; pthread_cond_broadcast(&pipeline.c);
+  pthread_mutex_unlock(&pipeline.m);
+  for (size_t i = 0; i < pipeline.count; ++i) {
+    pthread_mutex_lock(&pipeline.slots[i].m);
+    pthread_cond_broadcast(&pipeline.slots[i].c);
+    pthread_mutex_unlock(&pipeline.slots[i].m);
+  }
+  if (reading) pthread_join(pipeline.reader, NULL);
+  for (size_t i = 0; i < started; ++i)
     pthread_join(workers[i].thread, NULL);
-    // Destroy pthread state for this worker
-    pthread_mutex_destroy(&workers[i].mi);
-    pthread_mutex_destroy(&workers[i].mo);
-    pthread_cond_destroy (&workers[i].ci);
-    pthread_cond_destroy (&workers[i].co);
+  // Destroy pthread state for the ring and every slot in it
+  for (size_t i = 0; i < pipeline.count; ++i) {
+    pthread_mutex_destroy(&pipeline.slots[i].m);
+    pthread_cond_destroy (&pipeline.slots[i].c);
   }
+  pthread_cond_destroy(&pipeline.c); pthread_mutex_destroy(&pipeline.m);
+  free(pipeline.slots); free(workers); aes128pool_destroy(&pool);
+  // Drain what is still buffered so that it counts as time spent writing
+  if (writer != NULL) {
+    mark = aes128ctr_now(); fflush(ofp);
+    aes128ctr_lap(&mark, &writer->write_seconds);
+  }
+  aes128ctr_stats_finish(stats, start);
   // Fetch the current position of the output stream and close both streams
   size_t pos = ftell(ofp); fclose(ifp); fclose(ofp);
+  // Without any threads, crypt the whole file on this one instead
+  if (!reading) pos = aes128ctr_crypt_path(nonce, key, path);
   return pos;
 }
 
+void* aes128ctr_reader_target(void* arg) {
+  aes128ctr_pipeline_t* pipeline = (aes128ctr_pipeline_t*)arg;
+  aes128ctr_thread_stats_t* stats = pipeline->stats;
+  aes128trace_name("reader");
+  uint64_t counter = 0; double mark = stats != NULL ? aes128ctr_now() : 0;
+  for (size_t n = 0;; ++n) {
+    aes128ctr_slot_t* slot = &pipeline->slots[n % pipeline->count];
+    // Wait for the writer to flush the chunk previously held by this slot
+    pthread_mutex_lock(&slot->m);
+    while (!pipeline->stop && slot->status != AES128CTR_SLOT_EMPTY)
+      pthread_cond_wait(&slot->c, &slot->m);
+    pthread_mutex_unlock(&slot->m);
+    if (stats != NULL) aes128ctr_lap(&mark, &stats->wait_seconds);
+    if (pipeline->stop) break;
+    // Attempt to read as many blocks for this slot as specified
+    slot->length = (slot->blocks = fread(slot->state, 16,
+      pipeline->blocks, pipeline->ifp)) << 4;
+    // Check to see that the requested number of blocks could not be read
+    if (slot->blocks < pipeline->blocks) {
+      fseek(pipeline->ifp, (counter << 4) + slot->length, SEEK_SET);
+      // Attempt to read a partial block into the next block
+      size_t bytes = fread(&slot->state[slot->blocks], 1, 16, pipeline->ifp);
+      // If we read non-zero bytes, then increment the block count and length
+      if (bytes > 0) {
+        ++slot->blocks; slot->length += bytes;
+      }
+    }
+    // Set the offset of the slot and increment the counter
+    slot->offset = counter; counter += slot->blocks;
+    if (stats != NULL) {
+      aes128ctr_lap(&mark, &stats->read_seconds);
+      stats->chunks += slot->length > 0; stats->read_bytes += slot->length;
+    }
+    if (slot->length > 0)
+      aes128trace(AES128TRACE_DISPATCH, slot->offset << 4, slot->length);
+    // Pass the chunk on to the workers; an empty chunk goes straight to the
+    // writer and tells everyone downstream to finish
+    pthread_mutex_lock(&slot->m);
+    slot->status = slot->length > 0 ?
+      AES128CTR_SLOT_FILLED : AES128CTR_SLOT_CRYPTED;
+    pthread_cond_broadcast(&slot->c);
+    pthread_mutex_unlock(&slot->m);
+    pthread_mutex_lock(&pipeline->m);
+    if (slot->length > 0) ++pipeline->filled;
+    else pipeline->eof = 1;
+    pthread_cond_broadcast(&pipeline->c);
+    pthread_mutex_unlock(&pipeline->m);
+    if (slot->length == 0) break;
+  } return NULL;
+}
+
 void* aes128ctr_pthread_target(void* arg) {
   // Create a pointer to this worker's information structure
   aes128ctr_worker_t* worker = (aes128ctr_worker_t*)arg;
+  aes128ctr_pipeline_t* pipeline = worker->pipeline;
+  aes128ctr_thread_stats_t* stats = worker->stats;
+  double mark = stats != NULL ? aes128ctr_now() : 0;
+  aes128trace_name("worker");
   for (;;) {
-    // Wait for the signal to begin processing data
-    pthread_mutex_lock(&worker->mi);
-    #if DEBUG
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[Thread %lu] Waiting for data ...\n", worker->tid);
-      pthread_mutex_unlock(&io);
-    #endif
-    while (!worker->stop && !worker->vi)
-      pthread_cond_wait(&worker->ci, &worker->mi);
-    #if DEBUG
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[Thread %lu] Stop: %d\n", worker->tid, worker->stop);
-      pthread_mutex_unlock(&io);
-    #endif
-    if (worker->stop) pthread_exit(NULL);
-    worker->vi = 0; pthread_cond_signal(&worker->ci);
-    pthread_mutex_unlock(&worker->mi);
-    // Iterate over each block and encrypt it
-    for (size_t i = 0; i < worker->blocks; ++i)
-      aes128ctr_crypt(worker->nonce, worker->key,
-        &worker->state[i], worker->offset + i);
-    // Signal the main thread that we're done processing data
-    pthread_mutex_lock(&worker->mo);
-    #if DEBUG
-      pthread_mutex_lock(&io);
-      fprintf(stderr, "[Thread %lu] Processing complete.\n", worker->tid);
-      pthread_mutex_unlock(&io);
-    #endif
-    worker->vo = 1; pthread_cond_signal(&worker->co);
-    pthread_mutex_unlock(&worker->mo);
+    // Claim the oldest chunk that has been read but not yet crypted
+    pthread_mutex_lock(&pipeline->m);
+    while (pipeline->claimed == pipeline->filled && !pipeline->eof &&
+        !pipeline->stop)
+      pthread_cond_wait(&pipeline->c, &pipeline->m);
+    int done = pipeline->claimed == pipeline->filled || pipeline->stop;
+    size_t n = pipeline->claimed; pipeline->claimed += !done;
+    pthread_mutex_unlock(&pipeline->m);
+    if (stats != NULL) aes128ctr_lap(&mark, &stats->wait_seconds);
+    if (done) break;
+    // Encrypt every block held by this slot
+    aes128ctr_slot_t* slot = &pipeline->slots[n % pipeline->count];
+    aes128trace(AES128TRACE_START,  slot->offset << 4, slot->length);
+    aes128ctr_crypt_blocks(worker->nonce, worker->key,
+      slot->offset, slot->state, slot->blocks);
+    aes128trace(AES128TRACE_FINISH, slot->offset << 4, slot->length);
+    if (stats != NULL) {
+      aes128ctr_lap(&mark, &stats->crypt_seconds);
+      ++stats->chunks; stats->blocks += slot->blocks;
+    }
+    // Signal the writer that this chunk is ready to be flushed
+    pthread_mutex_lock(&slot->m);
+    slot->status = AES128CTR_SLOT_CRYPTED; pthread_cond_broadcast(&slot->c);
+    pthread_mutex_unlock(&slot->m);
   } return NULL;
 }
+
+extern size_t aes128ctr_crypt_path_pread(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* path,
+    const aes128ctr_config_t* config, aes128ctr_stats_t* stats) {
+  struct stat st;
+  aes128ctr_stats_start(stats, 0);
+  // Open the file once; every worker reads and writes it by offset
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0) {
+    close(fd); return 0;
+  }
+  // Every byte is read once, front to back within each worker's share
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t total = aes128ctr_pread_run(nonce, key, fd, fd, fd, 1, 0,
+    0, (uint64_t)st.st_size, config, stats);
+  close(fd);
+  return total;
+}
+
+extern size_t aes128ctr_crypt_path_copy(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* src, const char* dst,
+    const aes128ctr_config_t* config) {
+  aes128ctr_config_t copy = *config; struct stat st; char temp[4096];
+  int in_fd = open(src, O_RDONLY);
+  if (in_fd < 0) return 0;
+  if (fstat(in_fd, &st) != 0 || snprintf(temp, sizeof(temp), "%s.XXXXXX",
+      dst) >= (int)sizeof(temp)) {
+    close(in_fd); return 0;
+  }
+  // Build the output beside its destination so that it can be renamed
+  // into place, and reserve its blocks up front so workers writing out of
+  // order never fragment it
+  int out_fd = mkstemp(temp);
+  if (out_fd < 0) {
+    close(in_fd); return 0;
+  }
+  const uint64_t size = (uint64_t)st.st_size;
+  fchmod(out_fd, st.st_mode & 07777);
+  int ready = size == 0 || fallocate(out_fd, 0, 0, (off_t)size) == 0 ||
+    ftruncate(out_fd, (off_t)size) == 0;
+  // Every chunk is read from the source and written at the same offset of
+  // the output
+  if (size < copy.threshold) copy.threads = 1;
+  posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t total = !ready ? 0 : aes128ctr_pread_run(nonce, key, in_fd,
+    out_fd, in_fd, 1, 0, 0, size, &copy, NULL);
+  close(in_fd);
+  // Only a complete, durable output replaces the destination
+  int ok = ready && total == size && fdatasync(out_fd) == 0;
+  if (close(out_fd) != 0) ok = 0;
+  if (!ok || rename(temp, dst) != 0) {
+    unlink(temp); return 0;
+  } return total;
+}
+
+extern size_t aes128ctr_crypt_path_range(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* path, uint64_t offset,
+    uint64_t length, const aes128ctr_config_t* config) {
+  aes128ctr_config_t range = *config; struct stat st;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0) {
+    close(fd); return 0;
+  }
+  // Clamp the range to the end of the file
+  const uint64_t size = (uint64_t)st.st_size;
+  if (offset >= size) {
+    close(fd); return 0;
+  }
+  if (length > size - offset) length = size - offset;
+  // Only the requested range is read, crypted and written back; small
+  // ranges stay on one worker
+  if (length < range.threshold) range.threads = 1;
+  posix_fadvise(fd, (off_t)offset, (off_t)length, POSIX_FADV_SEQUENTIAL);
+  size_t total = aes128ctr_pread_run(nonce, key, fd, fd, fd, 1, 0,
+    offset, length, &range, NULL);
+  close(fd);
+  return total;
+}
+
+extern void aes128ctr_shard(uint64_t size, size_t index, size_t count,
+    uint64_t* offset, uint64_t* length) {
+  // Deal whole pages out as evenly as possible; only the last shard ends
+  // off the alignment boundary, and trailing shards of a tiny file may be
+  // empty
+  const uint64_t units = (size + AES128CTR_SHARD_ALIGN - 1) /
+    AES128CTR_SHARD_ALIGN;
+  uint64_t start = units * index / count * AES128CTR_SHARD_ALIGN;
+  uint64_t end   = units * (index + 1) / count * AES128CTR_SHARD_ALIGN;
+  if (start > size) start = size;
+  if (end   > size) end   = size;
+  *offset = start; *length = end - start;
+}
+
+extern size_t aes128ctr_crypt_path_direct(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* path,
+    const aes128ctr_config_t* config, aes128ctr_stats_t* stats) {
+  struct stat st; size_t align = (size_t)sysconf(_SC_PAGESIZE);
+  aes128ctr_stats_start(stats, 0);
+  // Bypass the page cache where the file system and chunk size allow it;
+  // otherwise keep the buffered descriptor and drop each range from the
+  // cache once written
+  int tail_fd = open(path, O_RDWR), fd = -1;
+  if (tail_fd < 0) return 0;
+  #ifdef O_DIRECT
+    if (((config->blocks << 4) & (align - 1)) == 0)
+      fd = open(path, O_RDWR | O_DIRECT);
+  #endif
+  if (fd < 0) {
+    fd = tail_fd; align = 1;
+  }
+  if (fstat(tail_fd, &st) != 0) {
+    if (fd != tail_fd) close(fd);
+    close(tail_fd); return 0;
+  }
+  posix_fadvise(tail_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t total = aes128ctr_pread_run(nonce, key, fd, fd, tail_fd, align,
+    1, 0, (uint64_t)st.st_size, config, stats);
+  if (fd != tail_fd) close(fd);
+  close(tail_fd);
+  return total;
+}
+
+size_t aes128ctr_pread_run(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, int fd, int out_fd, int tail_fd, size_t align,
+    int nocache, uint64_t offset, uint64_t length,
+    const aes128ctr_config_t* config, aes128ctr_stats_t* stats) {
+  const size_t threads = config->threads, chunk = config->blocks << 4;
+  aes128sched_t sched; aes128pool_t pool;
+  const double start = aes128ctr_now();
+  aes128ctr_stats_start(stats, threads);
+  // Split the range into chunks queued on per-worker deques
+  if (!aes128sched_init(&sched, offset, length, chunk, threads))
+    return 0;
+  // Give every worker its own page-aligned buffer
+  if (!aes128pool_init(&pool, threads, chunk)) {
+    aes128sched_destroy(&sched); return 0;
+  }
+  // Create a pool of workers to process data
+  aes128ctr_worker_t* workers = calloc(threads, sizeof(*workers));
+  if (workers == NULL) {
+    aes128pool_destroy(&pool); aes128sched_destroy(&sched); return 0;
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers[i].tid   = i;       workers[i].sched   = &sched;
+    workers[i].fd    = fd;      workers[i].tail_fd = tail_fd;
+    workers[i].out_fd = out_fd;
+    workers[i].align = align;   workers[i].nocache = nocache;
+    workers[i].nonce = nonce;   workers[i].key     = key;
+    workers[i].state = aes128pool_buffer(&pool, i);
+    workers[i].stats = aes128ctr_stats_worker(stats, i);
+    workers[i].started = pthread_create(&workers[i].thread, NULL,
+      aes128ctr_pread_target, &workers[i]) == 0;
+  }
+  // The main thread performs no I/O of its own; it only stands in for a
+  // worker that could not be started, stealing whatever is left, and then
+  // waits for every chunk
+  for (size_t i = 0; i < threads; ++i)
+    if (!workers[i].started) aes128ctr_pread_target(&workers[i]);
+  size_t total = aes128sched_wait(&sched);
+  for (size_t i = 0; i < threads; ++i)
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+  // Chunks that failed early may still have been in flight above
+  total = sched.bytes;
+  if (stats != NULL) stats->steals = sched.steals;
+  aes128sched_destroy(&sched); aes128pool_destroy(&pool); free(workers);
+  aes128ctr_stats_finish(stats, start);
+  return total;
+}
+
+void* aes128ctr_pread_target(void* arg) {
+  aes128trace_name("worker");
+  aes128ctr_pread_chunks((aes128ctr_worker_t*)arg);
+  return NULL;
+}
+
+void aes128ctr_pread_chunks(aes128ctr_worker_t* worker) {
+  aes128sched_chunk_t chunk; aes128ctr_thread_stats_t* stats = worker->stats;
+  double mark = stats != NULL ? aes128ctr_now() : 0;
+  // Keep taking chunks, stealing from other workers once ours run out
+  while (aes128sched_next(worker->sched, worker->tid, &chunk)) {
+    if (stats != NULL) aes128ctr_lap(&mark, &stats->wait_seconds);
+    aes128trace(AES128TRACE_DISPATCH, chunk.offset, chunk.length);
+    // Only the last chunk of the file can end off an alignment boundary;
+    // its ragged end is transferred through the buffered descriptor
+    const off_t offset = (off_t)chunk.offset;
+    const size_t head = chunk.length & ~(worker->align - 1);
+    uint8_t* data = (uint8_t*)worker->state;
+    // Read, crypt and write back this range at its own file offset
+    size_t bytes = aes128ctr_pread_full(worker->fd, data, head, offset);
+    if (bytes == head && head < chunk.length)
+      bytes += aes128ctr_pread_full(worker->tail_fd, data + head,
+        chunk.length - head, offset + (off_t)head);
+    if (stats != NULL) aes128ctr_lap(&mark, &stats->read_seconds);
+    aes128trace(AES128TRACE_START,  chunk.offset, chunk.length);
+    aes128ctr_crypt_range(worker->nonce, worker->key,
+      chunk.offset, data, data, bytes);
+    aes128trace(AES128TRACE_FINISH, chunk.offset, chunk.length);
+    if (stats != NULL) aes128ctr_lap(&mark, &stats->crypt_seconds);
+    size_t written = bytes < chunk.length ? 0 :
+      aes128ctr_pwrite_full(worker->out_fd, data, head, offset);
+    if (written == head && head < chunk.length)
+      written += aes128ctr_pwrite_full(worker->tail_fd, data + head,
+        chunk.length - head, offset + (off_t)head);
+    // Start writeback of this range and evict the previous one, which has
+    // had a whole chunk's time to become clean
+    aes128trace(AES128TRACE_FLUSH, chunk.offset, written);
+    if (worker->nocache && written > 0) {
+      posix_fadvise(worker->tail_fd, offset, (off_t)chunk.length,
+        POSIX_FADV_DONTNEED);
+      if (worker->last_length > 0)
+        posix_fadvise(worker->tail_fd, (off_t)worker->last_offset,
+          (off_t)worker->last_length, POSIX_FADV_DONTNEED);
+      worker->last_offset = chunk.offset; worker->last_length = chunk.length;
+    }
+    if (stats != NULL) {
+      aes128ctr_lap(&mark, &stats->write_seconds);
+      ++stats->chunks;                stats->blocks += (bytes + 15) >> 4;
+      stats->read_bytes += bytes;     stats->write_bytes += written;
+    }
+    aes128sched_complete(worker->sched, &chunk, written);
+  }
+}
+
+size_t aes128ctr_pread_full(int fd, void* buf, size_t length, off_t offset) {
+  size_t done = 0;
+  // Repeat short reads until the range is filled or EOF/error is reached
+  while (done < length) {
+    ssize_t bytes = pread(fd, (uint8_t*)buf + done, length - done,
+      offset + (off_t)done);
+    if (bytes <= 0) break;
+    done += (size_t)bytes;
+  } return done;
+}
+
+size_t aes128ctr_read_full(int fd, void* buf, size_t length, int* error) {
+  size_t done = 0;
+  // Pipes return whatever is buffered; keep reading until the chunk is
+  // full or the stream ends
+  while (done < length) {
+    ssize_t bytes = read(fd, (uint8_t*)buf + done, length - done);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0) *error = 1;
+    if (bytes <= 0) break;
+    done += (size_t)bytes;
+  } return done;
+}
+
+size_t aes128ctr_pwrite_full(int fd, const void* buf, size_t length,
+    off_t offset) {
+  size_t done = 0;
+  // Repeat short writes until the whole range is on its way to disk
+  while (done < length) {
+    ssize_t bytes = pwrite(fd, (const uint8_t*)buf + done, length - done,
+      offset + (off_t)done);
+    if (bytes <= 0) break;
+    done += (size_t)bytes;
+  } return done;
+}
+
+double aes128ctr_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+void aes128ctr_lap(double* mark, double* seconds) {
+  // Charge the time since the last mark to `seconds` and start a new lap
+  double now = aes128ctr_now();
+  *seconds += now - *mark; *mark = now;
+}
+
+void aes128ctr_stats_start(aes128ctr_stats_t* stats, size_t threads) {
+  if (stats == NULL) return;
+  memset(stats, 0, sizeof(*stats));
+  if (threads == 0) return;
+  // Without room for per-worker counters only the I/O threads are counted
+  stats->workers = calloc(threads, sizeof(*stats->workers));
+  stats->threads = stats->workers != NULL ? threads : 0;
+}
+
+aes128ctr_thread_stats_t* aes128ctr_stats_worker(aes128ctr_stats_t* stats,
+    size_t tid) {
+  return stats != NULL && tid < stats->threads ? &stats->workers[tid] : NULL;
+}
+
+void aes128ctr_stats_finish(aes128ctr_stats_t* stats, double start) {
+  if (stats == NULL) return;
+  aes128ctr_thread_stats_t* total = &stats->total;
+  stats->seconds = aes128ctr_now() - start;
+  memset(total, 0, sizeof(*total));
+  // Sum up the counters of every worker
+  for (size_t i = 0; i < stats->threads; ++i) {
+    const aes128ctr_thread_stats_t* worker = &stats->workers[i];
+    total->chunks        += worker->chunks;
+    total->blocks        += worker->blocks;
+    total->read_bytes    += worker->read_bytes;
+    total->write_bytes   += worker->write_bytes;
+    total->crypt_seconds += worker->crypt_seconds;
+    total->wait_seconds  += worker->wait_seconds;
+    total->read_seconds  += worker->read_seconds;
+    total->write_seconds += worker->write_seconds;
+  }
+}
+
+extern void aes128ctr_stats_destroy(aes128ctr_stats_t* stats) {
+  free(stats->workers);
+  memset(stats, 0, sizeof(*stats));
+}
+
+extern size_t aes128ctr_crypt_path_mmap(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* path,
+    const aes128ctr_config_t* config) {
+  const size_t threads = config->threads; struct stat st;
+  // Open the file once for both reading and writing
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd); return 0;
+  }
+  size_t size = (size_t)st.st_size;
+  // Map the whole file so workers can transform it in place
+  uint8_t* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd); return 0;
+  }
+  // Every page is touched exactly once, front to back
+  madvise(data, size, MADV_SEQUENTIAL);
+  // Launch one worker per thread; each handles every `threads`th chunk
+  aes128ctr_mmap_worker_t* workers = calloc(threads, sizeof(*workers));
+  if (workers == NULL) {
+    munmap(data, size); close(fd); return 0;
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers[i].tid   = i;       workers[i].threads = threads;
+    workers[i].chunk = config->blocks << 4;
+    workers[i].nonce = nonce;   workers[i].key     = key;
+    workers[i].data  = data;    workers[i].length  = size;
+    workers[i].started = pthread_create(&workers[i].thread, NULL,
+      aes128ctr_mmap_target, &workers[i]) == 0;
+  }
+  // Sweep the chunks of any worker that could not be started here instead
+  for (size_t i = 0; i < threads; ++i)
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+    else aes128ctr_mmap_target(&workers[i]);
+  free(workers);
+  // Unmapping writes the dirty pages back through the page cache
+  if (munmap(data, size) != 0) size = 0;
+  close(fd);
+  return size;
+}
+
+void* aes128ctr_mmap_target(void* arg) {
+  // Create a pointer to this worker's information structure
+  aes128ctr_mmap_worker_t* worker = (aes128ctr_mmap_worker_t*)arg;
+  const size_t chunk  = worker->chunk;
+  const size_t stride = chunk * worker->threads;
+  // Interleave chunks across workers so they sweep the mapping together
+  for (size_t offset = worker->tid * chunk; offset < worker->length;
+      offset += stride) {
+    size_t length = worker->length - offset < chunk ?
+      worker->length - offset : chunk;
+    // Ask the kernel to start reading this worker's next chunk
+    if (offset + stride < worker->length) {
+      size_t next = offset + stride, page = sysconf(_SC_PAGESIZE);
+      size_t span = worker->length - next < chunk ?
+        worker->length - next : chunk;
+      madvise(worker->data + (next & ~(page - 1)), span + (next & (page - 1)),
+        MADV_WILLNEED);
+    }
+    // Crypt the chunk directly in the mapping, including a ragged end
+    aes128ctr_crypt_inplace(worker->nonce, worker->key, offset >> 4,
+      worker->data + offset, length);
+  } return NULL;
+}
+
+extern int aes128ctr_ctx_init(aes128ctr_ctx_t* ctx, const aes128_key_t* key,
+    const aes128_nonce_t* nonce, aes128ctr_nonce_policy_t policy,
+    const aes128ctr_config_t* config) {
+  const size_t threads = config->threads;
+  memset(ctx, 0, sizeof(*ctx));
+  // Expand the raw key once for the lifetime of the context
+  memcpy(ctx->key.val, key->val, 16); aes128_key_init(&ctx->key);
+  ctx->nonce  = *nonce;   ctx->policy = policy;   ctx->config = *config;
+  // Give every pooled worker a buffer, plus one for the calling thread
+  ctx->workers = calloc(threads + 1, sizeof(*ctx->workers));
+  if (ctx->workers == NULL || !aes128pool_init(&ctx->pool, threads + 1,
+      config->blocks << 4)) {
+    free(ctx->workers); memset(&ctx->key, 0, sizeof(ctx->key));
+    return 0;
+  }
+  pthread_mutex_init(&ctx->call, NULL); pthread_mutex_init(&ctx->m, NULL);
+  pthread_cond_init (&ctx->c,    NULL); pthread_cond_init (&ctx->done_c, NULL);
+  for (size_t i = 0; i <= threads; ++i) {
+    // The calling thread only runs jobs scheduled for a single worker
+    ctx->workers[i].tid   = i < threads ? i : 0;
+    ctx->workers[i].threads = threads;
+    ctx->workers[i].nonce = &ctx->job.nonce;  ctx->workers[i].key = &ctx->key;
+    ctx->workers[i].sched = &ctx->job.sched;  ctx->workers[i].ctx = ctx;
+    ctx->workers[i].state = aes128pool_buffer(&ctx->pool, i);
+  }
+  // Start the pool; its threads sleep until the first job is published
+  size_t started = 0;
+  while (started < threads && pthread_create(&ctx->workers[started].thread,
+      NULL, aes128ctr_ctx_target, &ctx->workers[started]) == 0)
+    ++started;
+  // If a thread could not be started, shrink the pool to those running and
+  // hand the calling thread the first unused worker
+  if (started < threads) {
+    ctx->config.threads = started; ctx->workers[started].tid = 0;
+  }
+  return 1;
+}
+
+extern size_t aes128ctr_ctx_crypt_path(aes128ctr_ctx_t* ctx,
+    const char* path, aes128_nonce_t* nonce) {
+  struct stat st;
+  // Open the file once; every worker reads and writes it by offset
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0) {
+    close(fd); return 0;
+  }
+  pthread_mutex_lock(&ctx->call);
+  aes128ctr_ctx_nonce(ctx, nonce);
+  size_t total = aes128ctr_ctx_run_file(ctx, fd, (uint64_t)st.st_size);
+  pthread_mutex_unlock(&ctx->call);
+  close(fd);
+  return total;
+}
+
+extern size_t aes128ctr_ctx_crypt_buffer(aes128ctr_ctx_t* ctx,
+    uint64_t counter, void* data, size_t length, aes128_nonce_t* nonce) {
+  pthread_mutex_lock(&ctx->call);
+  ctx->job.kind = AES128CTR_JOB_MEMORY; ctx->job.data    = data;
+  ctx->job.counter = counter;
+  aes128ctr_ctx_nonce(ctx, nonce);
+  size_t total = aes128ctr_ctx_run(ctx, length, ctx->config.blocks << 4,
+    length < ctx->config.threshold);
+  pthread_mutex_unlock(&ctx->call);
+  return total;
+}
+
+extern size_t aes128ctr_ctx_crypt_batch(aes128ctr_ctx_t* ctx,
+    aes128ctr_batch_file_t* files, size_t count) {
+  const size_t threads = ctx->config.threads;
+  const uint64_t large = threads < 2 ? UINT64_MAX :
+    (uint64_t)threads * (ctx->config.blocks << 4);
+  uint64_t bytes = 0; struct stat st; size_t done = 0, first, second;
+  // Refuse a batch that names one file twice, since crypting it twice
+  // would silently restore it (and two workers could race on it)
+  if (aes128ctr_batch_duplicate(files, count, &first, &second)) {
+    errno = EEXIST;
+    return 0;
+  }
+  // Only a file with a chunk for every worker is worth splitting
+  for (size_t i = 0; i < count; ++i)
+    if (files[i].size < large) bytes += files[i].size;
+  pthread_mutex_lock(&ctx->call);
+  // Deal the small files out to the pool whole, one per schedule chunk, so
+  // that many are in flight at once
+  ctx->job.kind = AES128CTR_JOB_BATCH;  ctx->job.files = files;
+  ctx->job.large = large;
+  if (count > 0)
+    aes128ctr_ctx_run(ctx, count, 1, bytes < ctx->config.threshold);
+  // Then split each large file across the whole pool in turn
+  for (size_t i = 0; i < count; ++i) {
+    if (files[i].size < large) continue;
+    int fd = open(files[i].path, O_RDWR);
+    if (fd < 0) continue;
+    if (fstat(fd, &st) == 0) {
+      ctx->job.nonce = files[i].nonce;
+      files[i].done  = aes128ctr_ctx_run_file(ctx, fd,
+        (uint64_t)st.st_size) == (uint64_t)st.st_size;
+    }
+    close(fd);
+  }
+  pthread_mutex_unlock(&ctx->call);
+  for (size_t i = 0; i < count; ++i)
+    done += files[i].done != 0;
+  return done;
+}
+
+extern int aes128ctr_batch_duplicate(aes128ctr_batch_file_t* files,
+    size_t count, size_t* first, size_t* second) {
+  struct stat st; int found = 0;
+  aes128ctr_batch_file_t** order = malloc(count * sizeof(*order) + 1);
+  if (order == NULL) return 0;
+  // Size up and identify every file
+  for (size_t i = 0; i < count; ++i) {
+    int ok = stat(files[i].path, &st) == 0;
+    files[i].done = 0;
+    files[i].size = ok ? (uint64_t)st.st_size : 0;
+    files[i].dev  = ok ? (uint64_t)st.st_dev  : 0;
+    files[i].ino  = ok ? (uint64_t)st.st_ino  : 0;
+    order[i] = &files[i];
+  }
+  // Sort by identity so that two names for one file end up side by side
+  qsort(order, count, sizeof(*order), aes128ctr_batch_compare);
+  for (size_t i = 1; !found && i < count; ++i)
+    if (order[i]->ino != 0 && order[i]->dev == order[i - 1]->dev &&
+        order[i]->ino == order[i - 1]->ino) {
+      size_t a = order[i - 1] - files, b = order[i] - files;
+      *first = a < b ? a : b; *second = a < b ? b : a;
+      found = 1;
+    }
+  free(order);
+  return found;
+}
+
+int aes128ctr_batch_compare(const void* a, const void* b) {
+  const aes128ctr_batch_file_t* x = *(aes128ctr_batch_file_t* const*)a;
+  const aes128ctr_batch_file_t* y = *(aes128ctr_batch_file_t* const*)b;
+  if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+  if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
+
+extern void aes128ctr_ctx_destroy(aes128ctr_ctx_t* ctx) {
+  // Wake every pooled worker so that it can exit
+  pthread_mutex_lock(&ctx->m);
+  ctx->stop = 1; pthread_cond_broadcast(&ctx->c);
+  pthread_mutex_unlock(&ctx->m);
+  for (size_t i = 0; i < ctx->config.threads; ++i)
+    pthread_join(ctx->workers[i].thread, NULL);
+  pthread_mutex_destroy(&ctx->call); pthread_mutex_destroy(&ctx->m);
+  pthread_cond_destroy (&ctx->c);    pthread_cond_destroy (&ctx->done_c);
+  aes128pool_destroy(&ctx->pool); free(ctx->workers);
+  // Zero-initialize the key material for security
+  memset(&ctx->key,   0, sizeof(ctx->key));
+  memset(&ctx->nonce, 0, sizeof(ctx->nonce));
+  memset(&ctx->job,   0, sizeof(ctx->job));
+}
+
+void aes128ctr_ctx_nonce(aes128ctr_ctx_t* ctx, aes128_nonce_t* nonce) {
+  ctx->job.nonce = ctx->nonce;
+  if (nonce != NULL) *nonce = ctx->nonce;
+  // Step the big-endian nonce so that no two calls share a key stream
+  if (ctx->policy == AES128CTR_NONCE_SEQUENTIAL)
+    for (int i = sizeof(ctx->nonce.val) - 1; i >= 0; --i)
+      if (++ctx->nonce.val[i] != 0) break;
+}
+
+extern void aes128ctr_derive_nonce(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* label, aes128_nonce_t* out) {
+  aes128_state_t state; aes128_key_t mac_key;
+  const uint64_t length = strlen(label);
+  // MAC under a key of its own, so that no MAC input can stand in for a
+  // counter block of the data key. It is the data key's encryption of the
+  // last counter block of a fixed nonce, which no byte offset can reach
+  memset(state.val, 0xFF, sizeof(state.val));
+  memcpy(state.val, "noncekey", 8);
+  aes128_encrypt(key, &state);
+  memcpy(mac_key.val, state.val, sizeof(state.val));
+  aes128_key_init(&mac_key);
+  // CBC-MAC the label, starting from a block that holds the base nonce and
+  // the label's length so that no input is a prefix of another
+  memcpy(state.val, nonce->val, 8);
+  for (int i = 0; i < 8; ++i)
+    state.val[8 + i] = (uint8_t)(length >> (56 - 8 * i));
+  aes128_encrypt(&mac_key, &state);
+  for (uint64_t i = 0; i < length; i += 16) {
+    for (uint64_t j = 0; j < 16 && i + j < length; ++j)
+      state.val[j] ^= (uint8_t)label[i + j];
+    aes128_encrypt(&mac_key, &state);
+  }
+  memcpy(out->val, state.val, sizeof(out->val));
+  // Zero-initialize the key material for security
+  memset(state.val, 0, sizeof(state.val));
+  memset(&mac_key, 0, sizeof(mac_key));
+}
+
+size_t aes128ctr_ctx_run_file(aes128ctr_ctx_t* ctx, int fd, uint64_t size) {
+  // The caller holds `call` and has chosen the job's nonce
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  ctx->job.kind  = AES128CTR_JOB_FILE;  ctx->job.fd      = fd;
+  ctx->job.align = 1;                   ctx->job.tail_fd = fd;
+  ctx->job.nocache = 0;                 ctx->job.counter = 0;
+  return aes128ctr_ctx_run(ctx, size, ctx->config.blocks << 4,
+    size < ctx->config.threshold);
+}
+
+size_t aes128ctr_ctx_run(aes128ctr_ctx_t* ctx, uint64_t length,
+    size_t chunk, int local) {
+  // Jobs too small to be worth waking the pool for run on the caller, as
+  // does every job if no pool thread could be started
+  if (ctx->config.threads == 0) local = 1;
+  const size_t threads = local ? 1 : ctx->config.threads;
+  if (!aes128sched_init(&ctx->job.sched, 0, length, chunk, threads))
+    return 0;
+  if (local)
+    aes128ctr_ctx_chunks(&ctx->workers[ctx->config.threads]);
+  else {
+    // Publish the job and wait until no worker touches it any longer
+    pthread_mutex_lock(&ctx->m);
+    ctx->finished = 0; ++ctx->generation; pthread_cond_broadcast(&ctx->c);
+    while (ctx->finished < threads)
+      pthread_cond_wait(&ctx->done_c, &ctx->m);
+    pthread_mutex_unlock(&ctx->m);
+  }
+  size_t total = ctx->job.sched.bytes;
+  aes128sched_destroy(&ctx->job.sched);
+  return total;
+}
+
+void* aes128ctr_ctx_target(void* arg) {
+  // Create a pointer to this worker's information structure
+  aes128ctr_worker_t* worker = (aes128ctr_worker_t*)arg;
+  aes128ctr_ctx_t*    ctx    = worker->ctx;
+  for (size_t seen = 0;;) {
+    // Sleep until a job newer than the last one is published
+    pthread_mutex_lock(&ctx->m);
+    while (!ctx->stop && ctx->generation == seen)
+      pthread_cond_wait(&ctx->c, &ctx->m);
+    if (ctx->stop) {
+      pthread_mutex_unlock(&ctx->m); break;
+    }
+    seen = ctx->generation;
+    pthread_mutex_unlock(&ctx->m);
+    aes128trace_name("worker");
+    aes128ctr_ctx_chunks(worker);
+    // Report that this worker is done with the job
+    pthread_mutex_lock(&ctx->m);
+    ++ctx->finished; pthread_cond_signal(&ctx->done_c);
+    pthread_mutex_unlock(&ctx->m);
+  } return NULL;
+}
+
+void aes128ctr_ctx_chunks(aes128ctr_worker_t* worker) {
+  aes128ctr_job_t* job = &worker->ctx->job;
+  aes128sched_chunk_t chunk;
+  if (job->kind == AES128CTR_JOB_BATCH) {
+    // Each chunk of the schedule is one file; a failed file does not stop
+    // the rest of the batch
+    while (aes128sched_next(worker->sched, worker->tid, &chunk)) {
+      aes128ctr_batch_file_t* file = &job->files[chunk.offset];
+      if (file->size < job->large)
+        file->done = aes128ctr_ctx_file(worker, file);
+      aes128sched_complete(worker->sched, &chunk, chunk.length);
+    }
+    return;
+  }
+  if (job->kind == AES128CTR_JOB_FILE) {
+    // Reuse the positional I/O loop against the job's descriptors
+    worker->fd    = job->fd;     worker->tail_fd = job->tail_fd;
+    worker->out_fd = job->fd;
+    worker->align = job->align;  worker->nocache = job->nocache;
+    worker->last_length = 0;
+    aes128ctr_pread_chunks(worker);
+    return;
+  }
+  // Otherwise crypt the caller's memory in place, chunk by chunk
+  while (aes128sched_next(worker->sched, worker->tid, &chunk)) {
+    aes128trace(AES128TRACE_START,  chunk.offset, chunk.length);
+    aes128ctr_crypt_inplace(worker->nonce, worker->key,
+      job->counter + (chunk.offset >> 4), job->data + chunk.offset,
+      chunk.length);
+    aes128trace(AES128TRACE_FINISH, chunk.offset, chunk.length);
+    aes128sched_complete(worker->sched, &chunk, chunk.length);
+  }
+}
+
+int aes128ctr_ctx_file(aes128ctr_worker_t* worker,
+    aes128ctr_batch_file_t* file) {
+  const size_t chunk = worker->ctx->config.blocks << 4;
+  uint8_t* data = (uint8_t*)worker->state; struct stat st;
+  int fd = open(file->path, O_RDWR);
+  if (fd < 0) return 0;
+  // Crypt the whole file on this worker through its own buffer
+  int ok = fstat(fd, &st) == 0;
+  const uint64_t size = ok ? (uint64_t)st.st_size : 0;
+  for (uint64_t offset = 0; ok && offset < size; offset += chunk) {
+    size_t length = size - offset < chunk ? (size_t)(size - offset) : chunk;
+    ok = aes128ctr_pread_full(fd, data, length, (off_t)offset) == length;
+    if (ok) {
+      aes128ctr_crypt_range(&file->nonce, worker->key, offset, data, data,
+        length);
+      ok = aes128ctr_pwrite_full(fd, data, length, (off_t)offset) == length;
+    }
+  }
+  close(fd);
+  return ok;
+}
@@ -21,35 +21,297 @@
 #define __AES128CTR_H
 
 #include <pthread.h>
+#include <stdio.h>
 #include <time.h>
 
 #include "aes.h"
 #include "aes128.h"
+#include "aes128pool.h"
+#include "aes128sched.h"
 
+// Number of key stream blocks generated per batch by aes128ctr_crypt_blocks()
+#define AES128CTR_STREAM_BLOCKS 64
+
+// Blocks per chunk when the cache size of the host cannot be determined
 #ifndef AES128CTR_WORKER_BLOCK_COUNT
   #define AES128CTR_WORKER_BLOCK_COUNT 4096
 #endif
 
+// Bounds on the number of blocks per chunk chosen at run time
+#define AES128CTR_MIN_BLOCK_COUNT 256
+#define AES128CTR_MAX_BLOCK_COUNT 65536
+
+// Files below this many bytes are crypted without starting any threads
+// unless a tuned profile says otherwise
+#ifndef AES128CTR_THRESHOLD
+  #define AES128CTR_THRESHOLD (128 << 10)
+#endif
+
+// Shards of one file start on multiples of this many bytes, so that no
+// two processes ever write to the same page
+#define AES128CTR_SHARD_ALIGN 4096
+
+// Number of independent messages interleaved by aes128ctr_crypt_messages()
+#define AES128CTR_MESSAGE_LANES 8
+
+// Messages of at least this many bytes are crypted on their own, since a
+// single stream already fills the pipeline of every engine
+#define AES128CTR_MESSAGE_LONG (AES128CTR_STREAM_BLOCKS << 4)
+
+// Number of chunk buffers per worker in the pipelined path
+#define AES128CTR_WORKER_SLOTS 2
+
+// Stages a chunk slot moves through in the pipelined path
+#define AES128CTR_SLOT_EMPTY   0
+#define AES128CTR_SLOT_FILLED  1
+#define AES128CTR_SLOT_CRYPTED 2
+
+// Run-time tunables shared by the file drivers; files smaller than
+// `threshold` bytes are not worth starting threads for
+typedef struct {
+  size_t                 threads, blocks, depth, threshold;
+} aes128ctr_config_t;
+
+// What one thread of a file run spent its time on; waits are hand-offs
+// between threads (or, with positional I/O, taking the next chunk)
+typedef struct {
+  uint64_t               chunks, blocks, read_bytes, write_bytes;
+  double                 crypt_seconds, wait_seconds, read_seconds,
+                         write_seconds;
+} aes128ctr_thread_stats_t;
+
+// Counters of a whole file run, for reporting by the caller. `reader` and
+// `writer` are the I/O threads of the pipelined path and stay empty with
+// positional I/O, where every worker does its own. `workers` holds
+// `threads` entries until it is released by aes128ctr_stats_destroy().
+// `steals` counts chunks a worker took from another's share, which only
+// positional I/O does
+typedef struct {
+  size_t                 threads, steals;
+  double                 seconds;
+  aes128ctr_thread_stats_t reader, writer, total;
+  aes128ctr_thread_stats_t* workers;
+} aes128ctr_stats_t;
+
+typedef struct {
+  pthread_mutex_t        m;
+  pthread_cond_t         c;
+  int                    status;
+  uint64_t               offset;
+  size_t                 blocks, length;
+  aes128_state_t*        state;
+} aes128ctr_slot_t;
+
 typedef struct {
   volatile int           stop;
-  size_t                 tid;
+  size_t                 tid, threads;
   pthread_t              thread;
-  pthread_mutex_t        mi, mo;
-  pthread_cond_t         ci, co;
-  int                    vi, vo;
-  size_t                 offset, blocks, length;
+  int                    started;
+  // Positional I/O goes through `fd` in units of `align` bytes and is
+  // written back through `out_fd`; the ragged end of the file, if any,
+  // goes through the buffered `tail_fd`
+  int                    fd, out_fd, tail_fd, nocache;
+  size_t                 align;
+  uint64_t               last_offset;
+  size_t                 last_length;
   const aes128_nonce_t*  nonce;
   const aes128_key_t*    key;
-  aes128_state_t         state[AES128CTR_WORKER_BLOCK_COUNT];
+  aes128_state_t*        state;
+  aes128sched_t*         sched;
+  struct aes128ctr_ctx*  ctx;
+  struct aes128ctr_pipeline* pipeline;
+  // Counters of this worker, or NULL when the caller did not ask for them
+  aes128ctr_thread_stats_t* stats;
 } aes128ctr_worker_t;
 
+// A ring of chunks read from a stdio stream, crypted by whichever worker
+// claims them first and written back in counter order; slot `n % count`
+// holds chunk `n`
+typedef struct aes128ctr_pipeline {
+  pthread_mutex_t        m;
+  pthread_cond_t         c;
+  volatile int           stop;
+  int                    eof;
+  pthread_t              reader;
+  FILE*                  ifp;
+  // Chunks read and handed to a worker so far
+  size_t                 blocks, filled, claimed, count;
+  aes128ctr_slot_t*      slots;
+  aes128ctr_thread_stats_t* stats;
+} aes128ctr_pipeline_t;
+
+// One contiguous, block-aligned slice of a buffer crypted on its own thread
+typedef struct {
+  pthread_t              thread;
+  const aes128_nonce_t*  nonce;
+  const aes128_key_t*    key;
+  uint64_t               counter;
+  const uint8_t*         in;
+  uint8_t*               out;
+  size_t                 length;
+  int                    started;
+} aes128ctr_buffer_worker_t;
+
+// One chunk of a stream on its way from the reader through a worker to the
+// writer; chunks are numbered in stream order and slot `n % count` holds
+// chunk `n`
+typedef struct {
+  int                    status;
+  uint64_t               counter;
+  size_t                 length;
+  uint8_t*               data;
+} aes128ctr_stream_slot_t;
+
+// A bounded ring of chunks shared by the threads of a streaming run
+typedef struct {
+  pthread_mutex_t        m;
+  pthread_cond_t         c;
+  int                    out_fd, eof, failed;
+  const aes128_nonce_t*  nonce;
+  const aes128_key_t*    key;
+  // Chunks read, handed to a worker and written so far
+  size_t                 filled, claimed, written, count;
+  uint64_t               bytes;
+  aes128ctr_stream_slot_t* slots;
+} aes128ctr_stream_t;
+
+// One independent message of a multi-stream call, crypted in place with
+// its own expanded key, nonce and starting counter
+typedef struct {
+  const aes128_key_t*    key;
+  const aes128_nonce_t*  nonce;
+  uint64_t               counter;
+  uint8_t*               data;
+  size_t                 length;
+} aes128ctr_message_t;
+
+// How a context chooses the nonce for each file or buffer it crypts
+typedef enum {
+  // Every call uses the context's nonce as is (e.g. to decrypt)
+  AES128CTR_NONCE_FIXED = 0,
+  // Every call uses the next nonce, counting up from the initial one
+  AES128CTR_NONCE_SEQUENTIAL
+} aes128ctr_nonce_policy_t;
+
+// Kinds of work a context hands to its pool
+#define AES128CTR_JOB_FILE   0
+#define AES128CTR_JOB_MEMORY 1
+#define AES128CTR_JOB_BATCH  2
+
+// One file of a batch and the nonce it is crypted with; `done` is set once
+// the whole file has been rewritten. `dev` and `ino` identify the file
+// whatever path names it, and are zero if it could not be found
+typedef struct {
+  const char*            path;
+  aes128_nonce_t         nonce;
+  uint64_t               size, dev, ino;
+  int                    done;
+} aes128ctr_batch_file_t;
+
+typedef struct {
+  int                    kind, fd, tail_fd, nocache;
+  size_t                 align;
+  uint8_t*               data;
+  uint64_t               counter;
+  // Files of a batch; those of at least `large` bytes are split across
+  // the pool one at a time instead
+  aes128ctr_batch_file_t* files;
+  uint64_t               large;
+  aes128_nonce_t         nonce;
+  aes128sched_t          sched;
+} aes128ctr_job_t;
+
+// A long-lived key, nonce policy, worker pool and set of buffers that can
+// crypt many files and buffers without per-call setup
+typedef struct aes128ctr_ctx {
+  aes128_key_t           key;
+  aes128_nonce_t         nonce;
+  aes128ctr_nonce_policy_t policy;
+  aes128ctr_config_t     config;
+  aes128pool_t           pool;
+  // One more worker than threads; the last runs small jobs on the caller
+  aes128ctr_worker_t*    workers;
+  // `call` serializes callers; `m` guards the hand-off of each job
+  pthread_mutex_t        call, m;
+  pthread_cond_t         c, done_c;
+  size_t                 generation, finished;
+  volatile int           stop;
+  aes128ctr_job_t        job;
+} aes128ctr_ctx_t;
+
+typedef struct {
+  size_t                 tid, threads;
+  pthread_t              thread;
+  uint8_t*               data;
+  size_t                 length, chunk;
+  const aes128_nonce_t*  nonce;
+  const aes128_key_t*    key;
+  int                    started;
+} aes128ctr_mmap_worker_t;
+
+extern void aes128ctr_config_init(aes128ctr_config_t* config);
+extern int aes128ctr_ctx_init(aes128ctr_ctx_t* ctx, const aes128_key_t* key,
+  const aes128_nonce_t* nonce, aes128ctr_nonce_policy_t policy,
+  const aes128ctr_config_t* config);
+extern size_t aes128ctr_ctx_crypt_path(aes128ctr_ctx_t* ctx,
+  const char* path, aes128_nonce_t* nonce);
+extern size_t aes128ctr_ctx_crypt_buffer(aes128ctr_ctx_t* ctx,
+  uint64_t counter, void* data, size_t length, aes128_nonce_t* nonce);
+extern size_t aes128ctr_ctx_crypt_batch(aes128ctr_ctx_t* ctx,
+  aes128ctr_batch_file_t* files, size_t count);
+extern int aes128ctr_batch_duplicate(aes128ctr_batch_file_t* files,
+  size_t count, size_t* first, size_t* second);
+extern void aes128ctr_ctx_destroy(aes128ctr_ctx_t* ctx);
+extern void aes128ctr_derive_nonce(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* label, aes128_nonce_t* out);
 extern void aes128ctr_crypt(const aes128_nonce_t* nonce,
   const aes128_key_t* key, aes128_state_t* state, uint64_t counter);
+extern void aes128ctr_keystream(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+  size_t blocks);
+extern void aes128ctr_crypt_blocks(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* state,
+  size_t blocks);
+extern void aes128ctr_crypt_buffer(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, const void* in, void* out,
+  size_t length);
+extern void aes128ctr_crypt_inplace(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, void* data, size_t length);
+extern void aes128ctr_crypt_messages(aes128ctr_message_t* messages,
+  size_t count);
+extern void aes128ctr_crypt_range(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t offset, const void* in, void* out,
+  size_t length);
+extern void aes128ctr_crypt_buffer_parallel(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, const void* in, void* out,
+  size_t length, const aes128ctr_config_t* config);
+extern int aes128ctr_crypt_stream(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, int in_fd, int out_fd,
+  const aes128ctr_config_t* config, uint64_t* bytes);
 extern size_t aes128ctr_crypt_block_file(const aes128_nonce_t* nonce,
   const aes128_key_t* key, FILE* ifp, FILE* ofp, const uint64_t counter);
 extern size_t aes128ctr_crypt_path(const aes128_nonce_t* nonce,
   const aes128_key_t* key, const char* path);
 extern size_t aes128ctr_crypt_path_pthread(const aes128_nonce_t* nonce,
-  const aes128_key_t* key, const char* path, size_t threads);
+  const aes128_key_t* key, const char* path,
+  const aes128ctr_config_t* config, aes128ctr_stats_t* stats);
+extern size_t aes128ctr_crypt_path_pread(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* path,
+  const aes128ctr_config_t* config, aes128ctr_stats_t* stats);
+extern size_t aes128ctr_crypt_path_copy(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* src, const char* dst,
+  const aes128ctr_config_t* config);
+extern size_t aes128ctr_crypt_path_range(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* path, uint64_t offset,
+  uint64_t length, const aes128ctr_config_t* config);
+extern void aes128ctr_shard(uint64_t size, size_t index, size_t count,
+  uint64_t* offset, uint64_t* length);
+extern size_t aes128ctr_crypt_path_direct(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* path,
+  const aes128ctr_config_t* config, aes128ctr_stats_t* stats);
+extern size_t aes128ctr_crypt_path_mmap(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* path,
+  const aes128ctr_config_t* config);
+extern void aes128ctr_stats_destroy(aes128ctr_stats_t* stats);
 
 #endif
@@ -0,0 +1,184 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128ni.h"
+
+#if AES128NI_AVAILABLE
+
+#include <immintrin.h>
+
+#define AES128NI_TARGET      __attribute__((target("aes,sse2")))
+#define AES128NI_VAES_TARGET __attribute__((target("aes,avx512f,vaes")))
+
+// Derive the next round key from the previous one and its assist value
+#define AES128NI_KEY_STEP(rk, i, rcon) do {                               \
+    __m128i gen = _mm_shuffle_epi32(                                      \
+      _mm_aeskeygenassist_si128(rk[(i) - 1], (rcon)), 0xFF);              \
+    __m128i tmp = rk[(i) - 1];                                            \
+    tmp = _mm_xor_si128(tmp, _mm_slli_si128(tmp, 4));                     \
+    tmp = _mm_xor_si128(tmp, _mm_slli_si128(tmp, 4));                     \
+    tmp = _mm_xor_si128(tmp, _mm_slli_si128(tmp, 4));                     \
+    rk[(i)] = _mm_xor_si128(tmp, gen);                                    \
+  } while (0)
+
+AES128NI_TARGET
+void aes128ni_load_key(const aes128_key_t* key, __m128i* rk);
+AES128NI_TARGET __attribute__((always_inline))
+static inline void aes128ni_ctr_crypt_group(const aes128_key_t* const* keys,
+  const aes128_nonce_t* const* nonces, const uint64_t* counters,
+  uint8_t* const* blocks, size_t count);
+
+AES128NI_TARGET
+void aes128ni_load_key(const aes128_key_t* key, __m128i* rk) {
+  // The round keys share the byte layout of the portable key schedule
+  for (uint8_t i = 0; i < 11; ++i)
+    rk[i] = _mm_loadu_si128((const __m128i*)(key->val + (i << 4)));
+}
+
+AES128NI_TARGET
+extern void aes128ni_key_init(aes128_key_t* key) {
+  __m128i rk[11];
+  // Expand the key with AESKEYGENASSIST using the standard round constants
+  rk[0] = _mm_loadu_si128((const __m128i*)key->val);
+  AES128NI_KEY_STEP(rk,  1, 0x01); AES128NI_KEY_STEP(rk,  2, 0x02);
+  AES128NI_KEY_STEP(rk,  3, 0x04); AES128NI_KEY_STEP(rk,  4, 0x08);
+  AES128NI_KEY_STEP(rk,  5, 0x10); AES128NI_KEY_STEP(rk,  6, 0x20);
+  AES128NI_KEY_STEP(rk,  7, 0x40); AES128NI_KEY_STEP(rk,  8, 0x80);
+  AES128NI_KEY_STEP(rk,  9, 0x1B); AES128NI_KEY_STEP(rk, 10, 0x36);
+  for (uint8_t i = 0; i < 11; ++i)
+    _mm_storeu_si128((__m128i*)(key->val + (i << 4)), rk[i]);
+}
+
+AES128NI_TARGET
+extern void aes128ni_encrypt(const aes128_key_t* key, aes128_state_t* state) {
+  __m128i rk[11];
+  aes128ni_load_key(key, rk);
+  // Run the ten rounds of the cipher on a single block
+  __m128i b = _mm_xor_si128(_mm_loadu_si128((__m128i*)state->val), rk[0]);
+  for (uint8_t i = 1; i < 10; ++i)
+    b = _mm_aesenc_si128(b, rk[i]);
+  _mm_storeu_si128((__m128i*)state->val, _mm_aesenclast_si128(b, rk[10]));
+}
+
+AES128NI_TARGET
+extern void aes128ni_ctr_keystream(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+    size_t blocks) {
+  __m128i rk[11], b[AES128NI_LANES];
+  uint64_t n; memcpy(&n, nonce->val, sizeof(n));
+  aes128ni_load_key(key, rk);
+  // Keep several independent counter blocks in flight to hide the latency
+  // of each AESENC behind its neighbours
+  for (; blocks >= AES128NI_LANES; blocks -= AES128NI_LANES) {
+    for (uint8_t j = 0; j < AES128NI_LANES; ++j)
+      b[j] = _mm_xor_si128(_mm_set_epi64x(
+        (long long)__builtin_bswap64(counter + j), (long long)n), rk[0]);
+    for (uint8_t i = 1; i < 10; ++i)
+      for (uint8_t j = 0; j < AES128NI_LANES; ++j)
+        b[j] = _mm_aesenc_si128(b[j], rk[i]);
+    for (uint8_t j = 0; j < AES128NI_LANES; ++j)
+      _mm_storeu_si128((__m128i*)out[j].val,
+        _mm_aesenclast_si128(b[j], rk[10]));
+    counter += AES128NI_LANES; out += AES128NI_LANES;
+  }
+  // Finish any remaining blocks one at a time
+  for (; blocks > 0; --blocks, ++counter, ++out) {
+    __m128i c = _mm_xor_si128(_mm_set_epi64x(
+      (long long)__builtin_bswap64(counter), (long long)n), rk[0]);
+    for (uint8_t i = 1; i < 10; ++i)
+      c = _mm_aesenc_si128(c, rk[i]);
+    _mm_storeu_si128((__m128i*)out->val, _mm_aesenclast_si128(c, rk[10]));
+  }
+}
+
+AES128NI_TARGET
+extern void aes128ni_ctr_crypt_lanes(const aes128_key_t* const* keys,
+    const aes128_nonce_t* const* nonces, const uint64_t* counters,
+    uint8_t* const* blocks, size_t lanes) {
+  // Full groups have a constant lane count so they stay in registers
+  for (; lanes >= AES128NI_LANES; lanes -= AES128NI_LANES) {
+    aes128ni_ctr_crypt_group(keys, nonces, counters, blocks, AES128NI_LANES);
+    keys += AES128NI_LANES; nonces += AES128NI_LANES;
+    counters += AES128NI_LANES; blocks += AES128NI_LANES;
+  }
+  if (lanes > 0)
+    aes128ni_ctr_crypt_group(keys, nonces, counters, blocks, lanes);
+}
+
+AES128NI_TARGET __attribute__((always_inline))
+static inline void aes128ni_ctr_crypt_group(const aes128_key_t* const* keys,
+    const aes128_nonce_t* const* nonces, const uint64_t* counters,
+    uint8_t* const* blocks, size_t count) {
+  __m128i b[AES128NI_LANES];
+  // Every lane holds a block of a different stream under its own key, so
+  // the round keys are read per lane instead of being loaded up front
+  for (size_t j = 0; j < count; ++j) {
+    uint64_t n; memcpy(&n, nonces[j]->val, sizeof(n));
+    b[j] = _mm_xor_si128(_mm_set_epi64x(
+      (long long)__builtin_bswap64(counters[j]), (long long)n),
+      _mm_loadu_si128((const __m128i*)keys[j]->val));
+  }
+  for (uint8_t i = 1; i < 10; ++i)
+    for (size_t j = 0; j < count; ++j)
+      b[j] = _mm_aesenc_si128(b[j],
+        _mm_loadu_si128((const __m128i*)(keys[j]->val + (i << 4))));
+  // XOR each key stream block into its lane's data in place
+  for (size_t j = 0; j < count; ++j)
+    _mm_storeu_si128((__m128i*)blocks[j], _mm_xor_si128(
+      _mm_loadu_si128((const __m128i*)blocks[j]), _mm_aesenclast_si128(b[j],
+      _mm_loadu_si128((const __m128i*)(keys[j]->val + 160)))));
+}
+
+AES128NI_VAES_TARGET
+extern void aes128ni_ctr_keystream_vaes(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+    size_t blocks) {
+  __m512i rk[11], b[AES128NI_VLANES >> 2];
+  uint64_t n; memcpy(&n, nonce->val, sizeof(n));
+  // Broadcast each round key to all four 128-bit lanes
+  for (uint8_t i = 0; i < 11; ++i)
+    rk[i] = _mm512_broadcast_i32x4(
+      _mm_loadu_si128((const __m128i*)(key->val + (i << 4))));
+  for (; blocks >= AES128NI_VLANES; blocks -= AES128NI_VLANES) {
+    for (uint8_t j = 0; j < (AES128NI_VLANES >> 2); ++j) {
+      uint64_t c = counter + (j << 2);
+      b[j] = _mm512_xor_si512(_mm512_set_epi64(
+        (long long)__builtin_bswap64(c + 3), (long long)n,
+        (long long)__builtin_bswap64(c + 2), (long long)n,
+        (long long)__builtin_bswap64(c + 1), (long long)n,
+        (long long)__builtin_bswap64(c + 0), (long long)n), rk[0]);
+    }
+    for (uint8_t i = 1; i < 10; ++i)
+      for (uint8_t j = 0; j < (AES128NI_VLANES >> 2); ++j)
+        b[j] = _mm512_aesenc_epi128(b[j], rk[i]);
+    for (uint8_t j = 0; j < (AES128NI_VLANES >> 2); ++j)
+      _mm512_storeu_si512(out[j << 2].val,
+        _mm512_aesenclast_epi128(b[j], rk[10]));
+    counter += AES128NI_VLANES; out += AES128NI_VLANES;
+  }
+  // Hand the tail to the 128-bit kernel
+  if (blocks > 0) aes128ni_ctr_keystream(nonce, key, counter, out, blocks);
+}
+
+#endif
@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128NI_H
+#define __AES128NI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+#include "aes128.h"
+
+// The backend is only built where the compiler can target the instructions
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define AES128NI_AVAILABLE 1
+#else
+  #define AES128NI_AVAILABLE 0
+#endif
+
+// Number of independent blocks kept in flight by the AES-NI CTR kernel
+#define AES128NI_LANES   8
+// Number of blocks kept in flight by the VAES kernel (4 per ZMM register)
+#define AES128NI_VLANES 16
+
+extern void aes128ni_key_init(aes128_key_t* key);
+extern void aes128ni_encrypt(const aes128_key_t* key, aes128_state_t* state);
+extern void aes128ni_ctr_keystream(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+  size_t blocks);
+extern void aes128ni_ctr_crypt_lanes(const aes128_key_t* const* keys,
+  const aes128_nonce_t* const* nonces, const uint64_t* counters,
+  uint8_t* const* blocks, size_t lanes);
+extern void aes128ni_ctr_keystream_vaes(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint64_t counter, aes128_state_t* out,
+  size_t blocks);
+
+#endif
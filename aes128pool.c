@@ -0,0 +1,68 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "aes128pool.h"
+
+extern int aes128pool_init(aes128pool_t* pool, size_t count,
+    size_t buffer_size) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  memset(pool, 0, sizeof(*pool));
+  // Round every buffer up to whole pages so that each one starts aligned
+  // for O_DIRECT transfers
+  pool->count       = count;
+  pool->buffer_size = (buffer_size + page - 1) & ~(page - 1);
+  pool->size        = (count * pool->buffer_size + AES128POOL_HUGE_PAGE - 1) &
+    ~(size_t)(AES128POOL_HUGE_PAGE - 1);
+  if (pool->size == 0) return 0;
+  // Prefer reserved huge pages, which also keeps the buffers out of swap
+  #ifdef MAP_HUGETLB
+    pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    pool->huge = pool->data != MAP_FAILED;
+  #endif
+  // Otherwise use ordinary pages and ask for transparent huge pages
+  if (!pool->huge) {
+    pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->data == MAP_FAILED) {
+      pool->data = NULL; return 0;
+    }
+    #ifdef MADV_HUGEPAGE
+      madvise(pool->data, pool->size, MADV_HUGEPAGE);
+    #endif
+  }
+  return 1;
+}
+
+extern void* aes128pool_buffer(const aes128pool_t* pool, size_t index) {
+  return pool->data + index * pool->buffer_size;
+}
+
+extern void aes128pool_destroy(aes128pool_t* pool) {
+  if (pool->data != NULL) munmap(pool->data, pool->size);
+  pool->data = NULL;
+}
@@ -0,0 +1,41 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128POOL_H
+#define __AES128POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the huge pages the pool tries to back itself with
+#define AES128POOL_HUGE_PAGE (2 << 20)
+
+// A single mapping carved into equally sized, page-aligned buffers
+typedef struct {
+  uint8_t*               data;
+  size_t                 size, buffer_size, count;
+  int                    huge;
+} aes128pool_t;
+
+extern int aes128pool_init(aes128pool_t* pool, size_t count,
+  size_t buffer_size);
+extern void* aes128pool_buffer(const aes128pool_t* pool, size_t index);
+extern void aes128pool_destroy(aes128pool_t* pool);
+
+#endif
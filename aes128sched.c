@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes128sched.h"
+
+int aes128sched_pop(aes128sched_deque_t* deque, int steal, size_t* index);
+
+extern int aes128sched_init(aes128sched_t* sched, uint64_t offset,
+    uint64_t length, size_t chunk_size, size_t threads) {
+  memset(sched, 0, sizeof(*sched));
+  sched->offset     = offset;     sched->length  = length;
+  sched->chunk_size = chunk_size; sched->threads = threads;
+  sched->chunks     = (length + chunk_size - 1) / chunk_size;
+  sched->remaining  = sched->chunks;
+  sched->deques     = calloc(threads, sizeof(*sched->deques));
+  if (sched->deques == NULL) return 0;
+  // Seed each worker with a contiguous share of the chunks so that, absent
+  // stragglers, every worker streams through its own region of the range
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_mutex_init(&sched->deques[i].m, NULL);
+    sched->deques[i].head = sched->chunks * (i + 0) / threads;
+    sched->deques[i].tail = sched->chunks * (i + 1) / threads;
+  }
+  pthread_mutex_init(&sched->m, NULL);
+  pthread_cond_init (&sched->c, NULL);
+  return 1;
+}
+
+extern int aes128sched_next(aes128sched_t* sched, size_t tid,
+    aes128sched_chunk_t* chunk) {
+  size_t index = 0;
+  if (sched->failed) return 0;
+  // Prefer the next chunk of this worker's own share
+  int found = aes128sched_pop(&sched->deques[tid], 0, &index);
+  // Otherwise steal the last chunk from the first worker with work left
+  for (size_t i = 1; !found && i < sched->threads; ++i)
+    if ((found = aes128sched_pop(
+        &sched->deques[(tid + i) % sched->threads], 1, &index))) {
+      pthread_mutex_lock(&sched->m);
+      ++sched->steals;
+      pthread_mutex_unlock(&sched->m);
+    }
+  if (!found) return 0;
+  // Translate the chunk index into its byte range
+  chunk->index  = index;
+  chunk->offset = sched->offset + (uint64_t)index * sched->chunk_size;
+  chunk->length = sched->length - (uint64_t)index * sched->chunk_size <
+    sched->chunk_size ? (size_t)(sched->length -
+    (uint64_t)index * sched->chunk_size) : sched->chunk_size;
+  return 1;
+}
+
+extern void aes128sched_complete(aes128sched_t* sched,
+    const aes128sched_chunk_t* chunk, size_t bytes) {
+  pthread_mutex_lock(&sched->m);
+  // Record this chunk's outcome; a short chunk stops further dispatch
+  sched->bytes += bytes;
+  if (bytes < chunk->length) sched->failed = 1;
+  if (--sched->remaining == 0 || sched->failed)
+    pthread_cond_broadcast(&sched->c);
+  pthread_mutex_unlock(&sched->m);
+}
+
+extern size_t aes128sched_wait(aes128sched_t* sched) {
+  pthread_mutex_lock(&sched->m);
+  // Wait until every chunk has completed or one of them has failed
+  while (sched->remaining > 0 && !sched->failed)
+    pthread_cond_wait(&sched->c, &sched->m);
+  size_t bytes = sched->bytes;
+  pthread_mutex_unlock(&sched->m);
+  return bytes;
+}
+
+extern void aes128sched_destroy(aes128sched_t* sched) {
+  for (size_t i = 0; i < sched->threads; ++i)
+    pthread_mutex_destroy(&sched->deques[i].m);
+  pthread_mutex_destroy(&sched->m);
+  pthread_cond_destroy (&sched->c);
+  free(sched->deques); sched->deques = NULL;
+}
+
+int aes128sched_pop(aes128sched_deque_t* deque, int steal, size_t* index) {
+  int found = 0;
+  pthread_mutex_lock(&deque->m);
+  if (deque->head < deque->tail) {
+    *index = steal ? --deque->tail : deque->head++;
+    found  = 1;
+  }
+  pthread_mutex_unlock(&deque->m);
+  return found;
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128SCHED_H
+#define __AES128SCHED_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A contiguous byte range of work handed to one worker
+typedef struct {
+  size_t                 index;
+  uint64_t               offset;
+  size_t                 length;
+} aes128sched_chunk_t;
+
+// The chunk indices [head, tail) still queued for one worker; the owner
+// takes from the head, thieves take from the tail
+typedef struct {
+  pthread_mutex_t        m;
+  size_t                 head, tail;
+} aes128sched_deque_t;
+
+typedef struct {
+  uint64_t               offset, length;
+  size_t                 chunk_size, chunks, threads;
+  aes128sched_deque_t*   deques;
+  pthread_mutex_t        m;
+  pthread_cond_t         c;
+  size_t                 remaining, bytes, steals;
+  volatile int           failed;
+} aes128sched_t;
+
+extern int aes128sched_init(aes128sched_t* sched, uint64_t offset,
+  uint64_t length, size_t chunk_size, size_t threads);
+extern int aes128sched_next(aes128sched_t* sched, size_t tid,
+  aes128sched_chunk_t* chunk);
+extern void aes128sched_complete(aes128sched_t* sched,
+  const aes128sched_chunk_t* chunk, size_t bytes);
+extern size_t aes128sched_wait(aes128sched_t* sched);
+extern void aes128sched_destroy(aes128sched_t* sched);
+
+#endif
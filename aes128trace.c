@@ -0,0 +1,151 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes128trace.h"
+
+uint64_t aes128trace_now(void);
+aes128trace_ring_t* aes128trace_ring(void);
+void aes128trace_exit(void);
+
+int aes128trace_enabled = 0;
+
+// Every ring ever created, newest first; rings are pushed without a lock
+// and only freed once the trace has been written
+static _Atomic(aes128trace_ring_t*) aes128trace_rings = NULL;
+static atomic_size_t aes128trace_threads = 0;
+static _Thread_local aes128trace_ring_t* aes128trace_local = NULL;
+
+static uint64_t aes128trace_epoch = 0;
+static char     aes128trace_path[4096];
+
+static const char* aes128trace_names[AES128TRACE_TYPES] = {
+  "dispatch", "crypt", "crypt", "flush"
+};
+
+extern int aes128trace_start(const char* path) {
+  // Only one trace is written per process, when it exits
+  if (aes128trace_enabled || snprintf(aes128trace_path,
+      sizeof(aes128trace_path), "%s", path) >= (int)sizeof(aes128trace_path))
+    return 0;
+  if (atexit(aes128trace_exit) != 0) return 0;
+  aes128trace_epoch = aes128trace_now(); aes128trace_enabled = 1;
+  return 1;
+}
+
+extern void aes128trace_record(uint32_t type, uint64_t offset,
+    size_t length) {
+  aes128trace_ring_t* ring = aes128trace_ring();
+  if (ring == NULL) return;
+  // Only this thread writes its ring, so claiming a slot needs no atomic
+  // read-modify-write
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  aes128trace_event_t* event = &ring->events[head % AES128TRACE_EVENTS];
+  event->time   = aes128trace_now() - aes128trace_epoch;
+  event->offset = offset; event->length = (uint32_t)length;
+  event->type   = type;
+  // Publish the event once it is complete
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+extern void aes128trace_name(const char* role) {
+  if (!aes128trace_enabled) return;
+  aes128trace_ring_t* ring = aes128trace_ring();
+  if (ring != NULL)
+    snprintf(ring->name, sizeof(ring->name), "%s", role);
+}
+
+extern int aes128trace_dump(void) {
+  FILE* fp = fopen(aes128trace_path, "w");
+  if (fp == NULL) return 0;
+  const long pid = (long)getpid();
+  // Write the Chrome trace event format, one thread per ring
+  fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  for (aes128trace_ring_t* ring = atomic_load(&aes128trace_rings);
+      ring != NULL; ring = ring->next) {
+    fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, "
+      "\"tid\": %lu, \"args\": {\"name\": \"%s %lu\"}}",
+      ring == atomic_load(&aes128trace_rings) ? "" : ",", pid, ring->tid,
+      ring->name[0] != 0 ? ring->name : "thread", ring->tid);
+    // Only the newest events survive in a ring that has wrapped
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = head > AES128TRACE_EVENTS ? head - AES128TRACE_EVENTS : 0;
+    for (int open = 0; tail < head; ++tail) {
+      const aes128trace_event_t* event =
+        &ring->events[tail % AES128TRACE_EVENTS];
+      // Crypting is a slice; drop an end whose start was overwritten
+      if (event->type == AES128TRACE_FINISH && !open) continue;
+      if (event->type == AES128TRACE_START)  open = 1;
+      if (event->type == AES128TRACE_FINISH) open = 0;
+      const char* phase = event->type == AES128TRACE_START ? "B" :
+        event->type == AES128TRACE_FINISH ? "E" : "i";
+      fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"aes\", \"ph\": \"%s\", "
+        "%s\"ts\": %.3f, \"pid\": %ld, \"tid\": %lu, \"args\": "
+        "{\"offset\": %lu, \"length\": %u}}",
+        aes128trace_names[event->type % AES128TRACE_TYPES], phase,
+        *phase == 'i' ? "\"s\": \"t\", " : "", event->time / 1000.0, pid,
+        ring->tid, event->offset, event->length);
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  return fclose(fp) == 0;
+}
+
+uint64_t aes128trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+aes128trace_ring_t* aes128trace_ring(void) {
+  if (aes128trace_local != NULL) return aes128trace_local;
+  // Give this thread its own ring on its first event
+  aes128trace_ring_t* ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) return NULL;
+  ring->tid = atomic_fetch_add(&aes128trace_threads, 1) + 1;
+  atomic_init(&ring->head, 0);
+  // Push it onto the list of rings for the dump at exit
+  ring->next = atomic_load(&aes128trace_rings);
+  while (!atomic_compare_exchange_weak(&aes128trace_rings, &ring->next,
+      ring));
+  return aes128trace_local = ring;
+}
+
+void aes128trace_exit(void) {
+  // Stop recording before the rings are read and released
+  aes128trace_enabled = 0;
+  if (!aes128trace_dump())
+    fprintf(stderr, "warning: Could not write the trace to %s\n",
+      aes128trace_path);
+  aes128trace_ring_t* ring = atomic_exchange(&aes128trace_rings, NULL);
+  while (ring != NULL) {
+    aes128trace_ring_t* next = ring->next;
+    free(ring); ring = next;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128TRACE_H
+#define __AES128TRACE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Events kept per thread; once a ring is full the oldest are overwritten
+#ifndef AES128TRACE_EVENTS
+  #define AES128TRACE_EVENTS 4096
+#endif
+
+// What happened to a chunk: handed out for crypting, picked up and put
+// down by a worker, and written back
+#define AES128TRACE_DISPATCH 0
+#define AES128TRACE_START    1
+#define AES128TRACE_FINISH   2
+#define AES128TRACE_FLUSH    3
+#define AES128TRACE_TYPES    4
+
+// One fixed-size event; chunks are named by their byte offset
+typedef struct {
+  uint64_t               time, offset;
+  uint32_t               length, type;
+} aes128trace_event_t;
+
+// The events of one thread, written only by that thread; `head` counts
+// every event ever recorded
+typedef struct aes128trace_ring {
+  struct aes128trace_ring* next;
+  size_t                 tid;
+  char                   name[24];
+  atomic_uint_fast64_t   head;
+  aes128trace_event_t    events[AES128TRACE_EVENTS];
+} aes128trace_ring_t;
+
+// Nonzero while tracing; checked before any other work is done
+extern int aes128trace_enabled;
+
+extern int aes128trace_start(const char* path);
+extern void aes128trace_record(uint32_t type, uint64_t offset,
+  size_t length);
+extern void aes128trace_name(const char* role);
+extern int aes128trace_dump(void);
+
+// Record an event on the calling thread's ring if tracing is on
+static inline void aes128trace(uint32_t type, uint64_t offset,
+    size_t length) {
+  if (__builtin_expect(aes128trace_enabled, 0))
+    aes128trace_record(type, offset, length);
+}
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "aes128tune.h"
+#include "aes128uring.h"
+
+double aes128tune_now(void);
+aes128_engine_t aes128tune_engine(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, FILE* log);
+int aes128tune_scratch(char* path, size_t size);
+double aes128tune_time(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  const char* path, size_t bytes, const aes128ctr_config_t* config);
+double aes128tune_uring(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  const char* path, const aes128ctr_config_t* config);
+
+extern int aes128tune_run(aes128tune_profile_t* profile, FILE* log) {
+  aes128_nonce_t nonce = {{0}}; aes128_key_t key; aes128ctr_config_t config;
+  char path[4096];
+  memset(profile, 0, sizeof(*profile));
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  profile->cpus = cpus > 0 ? (size_t)cpus : 1;
+  // Any key will do; only the speed of each configuration matters
+  for (size_t i = 0; i < 16; ++i) key.val[i] = (uint8_t)i;
+  aes128_key_init(&key);
+  // Pick the fastest engine first, since every later run depends on it,
+  // unless the environment pins one that is supported
+  profile->engine = !aes128_engine_pinned(NULL) ?
+    aes128tune_engine(&nonce, &key, log) : aes128_engine();
+  aes128_engine_select(profile->engine);
+  // Time each thread count and chunk size on a scratch file in memory
+  if (!aes128tune_scratch(path, sizeof(path))) return 0;
+  aes128ctr_config_init(&config);
+  // Even a single processor gains from overlapping I/O with a worker, so
+  // always try at least two threads
+  const size_t limit = profile->cpus > 2 ? profile->cpus : 2;
+  double best = 0;
+  for (size_t threads = 1;; threads = threads * 2 < limit ?
+      threads * 2 : limit) {
+    // A single thread always takes the plain path, which has no chunks
+    for (size_t blocks = AES128CTR_MIN_BLOCK_COUNT << 2;
+        blocks <= AES128CTR_MAX_BLOCK_COUNT; blocks <<= 2) {
+      config.threads = threads; config.blocks = blocks;
+      double seconds = aes128tune_time(&nonce, &key, path, AES128TUNE_BYTES,
+        &config);
+      if (seconds <= 0) {
+        unlink(path); return 0;
+      }
+      double rate = AES128TUNE_BYTES / (double)(1 << 20) / seconds;
+      if (log != NULL)
+        fprintf(log, "autotune: %3lu threads x %5lu blocks %10.1f MB/s\n",
+          threads, threads > 1 ? blocks : 0, rate);
+      if (rate > best) {
+        best = rate; profile->threads = threads; profile->blocks = blocks;
+      }
+      if (threads == 1) break;
+    }
+    if (threads >= limit) break;
+  }
+  profile->rate = best;
+  // Find the smallest file size at which the threaded path starts to win
+  config.threads = profile->threads; config.blocks = profile->blocks;
+  profile->threshold = profile->threads > 1 ? AES128TUNE_BYTES : 0;
+  for (size_t bytes = 16 << 10; profile->threads > 1 &&
+      bytes < AES128TUNE_BYTES; bytes <<= 1) {
+    aes128ctr_config_t single = config; single.threads = 1;
+    if (truncate(path, (off_t)bytes) != 0) break;
+    double plain    = aes128tune_time(&nonce, &key, path, bytes, &single);
+    double threaded = aes128tune_time(&nonce, &key, path, bytes, &config);
+    if (plain > 0 && threaded > 0 && threaded < plain) {
+      profile->threshold = bytes; break;
+    }
+  }
+  // Find the io_uring queue depth that keeps the chosen pool busiest; keep
+  // the default where the kernel refuses io_uring
+  profile->depth = config.depth; best = 0;
+  for (size_t depth = AES128TUNE_MIN_DEPTH; depth <= AES128TUNE_MAX_DEPTH &&
+      truncate(path, AES128TUNE_BYTES) == 0; depth <<= 1) {
+    config.depth = depth;
+    double seconds = aes128tune_uring(&nonce, &key, path, &config);
+    if (seconds <= 0) break;
+    double rate = AES128TUNE_BYTES / (double)(1 << 20) / seconds;
+    if (log != NULL)
+      fprintf(log, "autotune: io_uring depth %3lu %10.1f MB/s\n", depth,
+        rate);
+    if (rate > best) {
+      best = rate; profile->depth = depth;
+    }
+  }
+  unlink(path);
+  return 1;
+}
+
+double aes128tune_now(void) {
+  struct timespec now = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+aes128_engine_t aes128tune_engine(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, FILE* log) {
+  const size_t blocks = AES128TUNE_ENGINE_BYTES >> 4;
+  const aes128_engine_t active = aes128_engine();
+  aes128_engine_t fastest = active; double best = 0;
+  aes128_state_t* state = calloc(blocks, sizeof(*state));
+  if (state == NULL) return fastest;
+  for (int i = 0; i < AES128_ENGINE_COUNT; ++i) {
+    if (!aes128_engine_select((aes128_engine_t)i)) continue;
+    // Keep the fastest of several passes to filter out scheduling noise
+    double seconds = 0;
+    for (size_t trial = 0; trial < AES128TUNE_TRIALS; ++trial) {
+      double start = aes128tune_now();
+      aes128ctr_crypt_blocks(nonce, key, 0, state, blocks);
+      double elapsed = aes128tune_now() - start;
+      if (trial == 0 || elapsed < seconds) seconds = elapsed;
+    }
+    double rate = seconds > 0 ?
+      AES128TUNE_ENGINE_BYTES / (double)(1 << 20) / seconds : 0;
+    if (log != NULL)
+      fprintf(log, "autotune: engine %-8s %10.1f MB/s\n",
+        aes128_engine_name((aes128_engine_t)i), rate);
+    if (rate > best) {
+      best = rate; fastest = (aes128_engine_t)i;
+    }
+  }
+  // Leave the engine that was active; the caller decides what to select
+  aes128_engine_select(active);
+  free(state);
+  return fastest;
+}
+
+int aes128tune_scratch(char* path, size_t size) {
+  const char* dirs[] = {"/dev/shm", getenv("TMPDIR"), "/tmp"};
+  uint8_t buffer[1 << 16];
+  memset(buffer, 0xA5, sizeof(buffer));
+  // Prefer tmpfs so that the runs measure this process rather than a disk
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); ++i) {
+    if (dirs[i] == NULL) continue;
+    snprintf(path, size, "%s/aes128tune.XXXXXX", dirs[i]);
+    int fd = mkstemp(path);
+    if (fd < 0) continue;
+    size_t done = 0;
+    while (done < AES128TUNE_BYTES) {
+      ssize_t bytes = write(fd, buffer, sizeof(buffer));
+      if (bytes <= 0) break;
+      done += (size_t)bytes;
+    }
+    close(fd);
+    if (done >= AES128TUNE_BYTES) return 1;
+    unlink(path);
+  } return 0;
+}
+
+double aes128tune_time(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    const char* path, size_t bytes, const aes128ctr_config_t* config) {
+  double best = 0;
+  // Time exactly the path that main would pick for this configuration
+  for (size_t trial = 0; trial < AES128TUNE_TRIALS; ++trial) {
+    double start = aes128tune_now();
+    size_t done = config->threads > 1 ?
+      aes128ctr_crypt_path_pthread(nonce, key, path, config, NULL) :
+      aes128ctr_crypt_path(nonce, key, path);
+    double elapsed = aes128tune_now() - start;
+    if (done != bytes) return 0;
+    if (trial == 0 || elapsed < best) best = elapsed;
+  } return best;
+}
+
+double aes128tune_uring(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    const char* path, const aes128ctr_config_t* config) {
+  aes128uring_stats_t stats; double best = 0;
+  for (size_t trial = 0; trial < AES128TUNE_TRIALS; ++trial) {
+    size_t done = aes128uring_crypt_path(nonce, key, path, config, &stats);
+    // A run that fell back to positional I/O says nothing about the depth
+    if (stats.fallback || done != AES128TUNE_BYTES) return 0;
+    if (trial == 0 || stats.seconds < best) best = stats.seconds;
+  } return best;
+}
+
+extern int aes128tune_path(char* path, size_t size) {
+  const char* env = getenv("AES128CTR_PROFILE");
+  const char* cache = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  int length = -1;
+  // An explicit path wins, then the XDG cache directory, then ~/.cache
+  if (env != NULL && *env != 0)
+    length = snprintf(path, size, "%s", env);
+  else if (cache != NULL && *cache != 0)
+    length = snprintf(path, size, "%s/aes128ctr.profile", cache);
+  else if (home != NULL && *home != 0)
+    length = snprintf(path, size, "%s/.cache/aes128ctr.profile", home);
+  return length > 0 && (size_t)length < size;
+}
+
+extern int aes128tune_load(aes128tune_profile_t* profile, const char* path) {
+  char line[128], name[32], value[64]; int engine = -1;
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) return 0;
+  memset(profile, 0, sizeof(*profile));
+  // Read each `name=value` line, ignoring anything unrecognized
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%31[^=]=%63s", name, value) != 2) continue;
+    if (strcmp(name, "engine") == 0) {
+      for (int i = 0; i < AES128_ENGINE_COUNT; ++i)
+        if (strcmp(value, aes128_engine_name((aes128_engine_t)i)) == 0)
+          engine = i;
+    } else if (strcmp(name, "cpus")      == 0)
+      profile->cpus      = strtoul(value, NULL, 10);
+    else if (strcmp(name, "threads")   == 0)
+      profile->threads   = strtoul(value, NULL, 10);
+    else if (strcmp(name, "blocks")    == 0)
+      profile->blocks    = strtoul(value, NULL, 10);
+    else if (strcmp(name, "threshold") == 0)
+      profile->threshold = strtoul(value, NULL, 10);
+    else if (strcmp(name, "depth")     == 0)
+      profile->depth     = strtoul(value, NULL, 10);
+    else if (strcmp(name, "rate")      == 0)
+      profile->rate      = strtod(value, NULL);
+  }
+  fclose(fp);
+  // A profile measured on different hardware is worse than none at all
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (engine < 0 || !aes128_engine_supported((aes128_engine_t)engine) ||
+      profile->cpus != (size_t)(cpus > 0 ? cpus : 1) ||
+      profile->threads == 0 || profile->blocks == 0)
+    return 0;
+  profile->engine = (aes128_engine_t)engine;
+  return 1;
+}
+
+extern int aes128tune_save(const aes128tune_profile_t* profile,
+    const char* path) {
+  char dir[4096], temp[4096];
+  // Create the containing directory if this is the first profile
+  snprintf(dir, sizeof(dir), "%s", path);
+  char* slash = strrchr(dir, '/');
+  if (slash != NULL && slash != dir) {
+    *slash = 0; mkdir(dir, 0755);
+  }
+  // Write a sibling file first so that readers never see half a profile
+  if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+    return 0;
+  FILE* fp = fopen(temp, "w");
+  if (fp == NULL) return 0;
+  fprintf(fp, "engine=%s\ncpus=%lu\nthreads=%lu\nblocks=%lu\n"
+    "threshold=%lu\ndepth=%lu\nrate=%.1f\n",
+    aes128_engine_name(profile->engine), profile->cpus, profile->threads,
+    profile->blocks, profile->threshold, profile->depth, profile->rate);
+  if (fclose(fp) != 0 || rename(temp, path) != 0) {
+    unlink(temp); return 0;
+  } return 1;
+}
+
+extern void aes128tune_apply(const aes128tune_profile_t* profile,
+    aes128ctr_config_t* config) {
+  // Settings pinned through the environment take precedence over a profile
+  if (!aes128_engine_pinned(NULL))
+    aes128_engine_select(profile->engine);
+  if (getenv("AES128CTR_THREADS") == NULL)
+    config->threads   = profile->threads;
+  if (getenv("AES128CTR_BLOCKS") == NULL)
+    config->blocks    = profile->blocks;
+  if (getenv("AES128CTR_THRESHOLD") == NULL)
+    config->threshold = profile->threshold;
+  // Profiles saved before the depth was tuned leave it at the default
+  if (getenv("AES128CTR_DEPTH") == NULL && profile->depth > 0)
+    config->depth     = profile->depth;
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128TUNE_H
+#define __AES128TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "aes128.h"
+#include "aes128ctr.h"
+
+// Size of the in-memory buffer used to compare engines
+#define AES128TUNE_ENGINE_BYTES (1 << 20)
+
+// Size of the scratch file each thread count and chunk size is timed on
+#ifndef AES128TUNE_BYTES
+  #define AES128TUNE_BYTES (16 << 20)
+#endif
+
+// Timed runs per candidate; only the fastest one counts
+#define AES128TUNE_TRIALS 2
+
+// Range of io_uring queue depths tried, doubling from the smallest
+#define AES128TUNE_MIN_DEPTH   8
+#define AES128TUNE_MAX_DEPTH 128
+
+// The fastest settings measured on this host
+typedef struct {
+  aes128_engine_t        engine;
+  size_t                 cpus, threads, blocks, threshold, depth;
+  double                 rate;
+} aes128tune_profile_t;
+
+extern int aes128tune_run(aes128tune_profile_t* profile, FILE* log);
+extern int aes128tune_path(char* path, size_t size);
+extern int aes128tune_load(aes128tune_profile_t* profile, const char* path);
+extern int aes128tune_save(const aes128tune_profile_t* profile,
+  const char* path);
+extern void aes128tune_apply(const aes128tune_profile_t* profile,
+  aes128ctr_config_t* config);
+
+#endif
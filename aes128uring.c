@@ -0,0 +1,349 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "aes128uring.h"
+
+#if AES128URING_AVAILABLE
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Older C libraries do not name the io_uring system calls yet
+#ifndef __NR_io_uring_setup
+  #define __NR_io_uring_setup    425
+  #define __NR_io_uring_enter    426
+  #define __NR_io_uring_register 427
+#endif
+
+int aes128uring_ring_init(aes128uring_ring_t* ring, unsigned entries);
+void aes128uring_ring_destroy(aes128uring_ring_t* ring);
+int aes128uring_init(aes128uring_t* uring);
+void aes128uring_free(aes128uring_t* uring);
+void aes128uring_destroy(aes128uring_t* uring);
+void aes128uring_prep(aes128uring_t* uring, int opcode, size_t index);
+size_t aes128uring_run(aes128uring_t* uring, uint64_t size,
+  aes128uring_stats_t* stats);
+void* aes128uring_target(void* arg);
+#endif
+
+extern size_t aes128uring_crypt_path(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, const char* path,
+    const aes128ctr_config_t* config, aes128uring_stats_t* stats) {
+  const size_t threads = config->threads, depth = config->depth;
+  aes128uring_stats_t unused; size_t total = 0;
+  struct timespec start = {0, 0}, end = {0, 0};
+  if (stats == NULL) stats = &unused;
+  memset(stats, 0, sizeof(*stats)); stats->depth = depth;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  #if AES128URING_AVAILABLE
+    struct stat st; aes128uring_t uring;
+    memset(&uring, 0, sizeof(uring));
+    uring.nonce = nonce; uring.key = key; uring.depth = depth;
+    uring.chunk = config->blocks << 4;
+    // Open the file once; reads and writes are both issued against it
+    if ((uring.fd = open(path, O_RDWR)) < 0) return 0;
+    if (fstat(uring.fd, &st) != 0) {
+      close(uring.fd); return 0;
+    }
+    // Set up the ring and pin its buffers, or fall back if either is refused
+    pthread_t* workers = calloc(threads, sizeof(*workers));
+    if (workers != NULL && depth > 0 && aes128uring_init(&uring)) {
+      size_t started = 0;
+      while (started < threads && pthread_create(&workers[started], NULL,
+          aes128uring_target, &uring) == 0)
+        ++started;
+      // Without a single worker nothing would crypt the completed reads
+      if (started > 0)
+        total = aes128uring_run(&uring, (uint64_t)st.st_size, stats);
+      else stats->fallback = 1;
+      // Wake every idle worker so that it can exit
+      pthread_mutex_lock(&uring.m);
+      uring.stop = 1; pthread_cond_broadcast(&uring.crypt_c);
+      pthread_mutex_unlock(&uring.m);
+      for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+      aes128uring_destroy(&uring);
+    } else stats->fallback = 1;
+    free(workers); close(uring.fd);
+  #else
+    (void)depth; (void)threads; stats->fallback = 1;
+  #endif
+  // Without io_uring the positional I/O path is the closest equivalent
+  if (stats->fallback)
+    total = aes128ctr_crypt_path_pread(nonce, key, path, config, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats->bytes   = total;
+  stats->seconds = (end.tv_sec - start.tv_sec) +
+    (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  return total;
+}
+
+#if AES128URING_AVAILABLE
+int aes128uring_ring_init(aes128uring_ring_t* ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p)); memset(ring, 0, sizeof(*ring));
+  // Ask the kernel for a ring; this fails where io_uring is disabled
+  if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return 0;
+  ring->sq_size  = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  ring->cq_size  = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  // Newer kernels let both rings share a single mapping
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+  // Map the rings and the submission queue entries into our address space
+  ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = single ? ring->sq_ring : mmap(NULL, ring->cq_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+    IORING_OFF_CQ_RING);
+  ring->sqes    = mmap(NULL, ring->sqe_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+  if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+  if (ring->sqes    == MAP_FAILED) ring->sqes    = NULL;
+  if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+    aes128uring_ring_destroy(ring); return 0;
+  }
+  // Locate the shared head, tail and mask fields inside each ring
+  uint8_t* sq = ring->sq_ring; uint8_t* cq = ring->cq_ring;
+  ring->sq_head  = (uint32_t*)(sq + p.sq_off.head);
+  ring->sq_tail  = (uint32_t*)(sq + p.sq_off.tail);
+  ring->sq_mask  = (uint32_t*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (uint32_t*)(sq + p.sq_off.array);
+  ring->cq_head  = (uint32_t*)(cq + p.cq_off.head);
+  ring->cq_tail  = (uint32_t*)(cq + p.cq_off.tail);
+  ring->cq_mask  = (uint32_t*)(cq + p.cq_off.ring_mask);
+  ring->cqes     = cq + p.cq_off.cqes;
+  return 1;
+}
+
+void aes128uring_ring_destroy(aes128uring_ring_t* ring) {
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqe_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_size);
+  if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_size);
+  // Closing the ring also drops the registered buffers
+  if (ring->fd >= 0) close(ring->fd);
+  ring->fd = -1;
+}
+
+int aes128uring_init(aes128uring_t* uring) {
+  const size_t chunk = uring->chunk;
+  // Allocate the buffer table, both hand-off queues and the buffers proper
+  uring->bufs    = calloc(uring->depth, sizeof(*uring->bufs));
+  uring->crypt_q = calloc(uring->depth, sizeof(*uring->crypt_q));
+  uring->write_q = calloc(uring->depth, sizeof(*uring->write_q));
+  if (uring->bufs == NULL || uring->crypt_q == NULL ||
+      uring->write_q == NULL ||
+      !aes128pool_init(&uring->pool, uring->depth, chunk)) {
+    free(uring->bufs); free(uring->crypt_q); free(uring->write_q);
+    return 0;
+  }
+  // The depth comes from the caller, so keep the table off the stack
+  struct iovec* iov = calloc(uring->depth, sizeof(*iov));
+  if (iov == NULL) {
+    aes128uring_free(uring); return 0;
+  }
+  for (size_t i = 0; i < uring->depth; ++i) {
+    uring->bufs[i].status = AES128URING_BUF_FREE;
+    uring->bufs[i].state  = aes128pool_buffer(&uring->pool, i);
+    iov[i].iov_base = uring->bufs[i].state; iov[i].iov_len = chunk;
+  }
+  // Every buffer has at most one request outstanding, so `depth` entries
+  // suffice; registering the buffers lets the kernel skip per-I/O pinning
+  if (!aes128uring_ring_init(&uring->ring, (unsigned)uring->depth)) {
+    free(iov); aes128uring_free(uring); return 0;
+  }
+  int registered = syscall(__NR_io_uring_register, uring->ring.fd,
+    IORING_REGISTER_BUFFERS, iov, (unsigned)uring->depth) == 0;
+  free(iov);
+  if (!registered) {
+    aes128uring_ring_destroy(&uring->ring); aes128uring_free(uring);
+    return 0;
+  }
+  pthread_mutex_init(&uring->m, NULL);
+  pthread_cond_init (&uring->crypt_c, NULL);
+  pthread_cond_init (&uring->write_c, NULL);
+  return 1;
+}
+
+void aes128uring_free(aes128uring_t* uring) {
+  aes128pool_destroy(&uring->pool);
+  free(uring->bufs); free(uring->crypt_q); free(uring->write_q);
+}
+
+void aes128uring_destroy(aes128uring_t* uring) {
+  aes128uring_ring_destroy(&uring->ring);
+  pthread_mutex_destroy(&uring->m);
+  pthread_cond_destroy (&uring->crypt_c);
+  pthread_cond_destroy (&uring->write_c);
+  aes128uring_free(uring);
+}
+
+void aes128uring_prep(aes128uring_t* uring, int opcode, size_t index) {
+  aes128uring_ring_t* ring = &uring->ring;
+  aes128uring_buf_t*  buf  = &uring->bufs[index];
+  // Only this thread submits, so the tail can be read without ordering
+  uint32_t tail = *ring->sq_tail, slot = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &((struct io_uring_sqe*)ring->sqes)[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  // Resume a short transfer where the previous completion left off
+  sqe->opcode    = (uint8_t)opcode;   sqe->fd  = uring->fd;
+  sqe->addr      = (uint64_t)(uintptr_t)((uint8_t*)buf->state + buf->done);
+  sqe->len       = (uint32_t)(buf->length - buf->done);
+  sqe->off       = buf->offset + buf->done;
+  sqe->buf_index = (uint16_t)index;   sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  // Publish the entry only after it has been completely written
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+size_t aes128uring_run(aes128uring_t* uring, uint64_t size,
+    aes128uring_stats_t* stats) {
+  const size_t chunk = uring->chunk;
+  aes128uring_ring_t* ring = &uring->ring;
+  uint64_t next = 0, total = 0; double depth_sum = 0;
+  size_t inflight = 0, busy = 0, queued = 0, samples = 0; int failed = 0;
+  for (;;) {
+    // Start reading into every free buffer while input remains
+    for (size_t i = 0; !failed && next < size && i < uring->depth; ++i) {
+      aes128uring_buf_t* buf = &uring->bufs[i];
+      if (buf->status != AES128URING_BUF_FREE) continue;
+      buf->offset = next; buf->done = 0;
+      buf->length = size - next < chunk ? (size_t)(size - next) : chunk;
+      buf->status = AES128URING_BUF_READING; next += buf->length;
+      aes128uring_prep(uring, IORING_OP_READ_FIXED, i);
+      ++inflight; ++busy; ++queued;
+    }
+    // With nothing in flight, the only way forward is a worker finishing
+    pthread_mutex_lock(&uring->m);
+    while (inflight == 0 && busy > 0 &&
+        uring->write_head == uring->write_tail)
+      pthread_cond_wait(&uring->write_c, &uring->m);
+    // Write back every buffer the workers have finished with
+    while (uring->write_head != uring->write_tail) {
+      size_t i = uring->write_q[uring->write_head++ % uring->depth];
+      aes128uring_buf_t* buf = &uring->bufs[i];
+      buf->done = 0;
+      if (failed) {
+        buf->status = AES128URING_BUF_FREE; --busy; continue;
+      }
+      buf->status = AES128URING_BUF_WRITING;
+      aes128uring_prep(uring, IORING_OP_WRITE_FIXED, i);
+      ++inflight; ++queued;
+    }
+    pthread_mutex_unlock(&uring->m);
+    if (inflight == 0 && busy == 0) break;
+    if (inflight == 0) continue;
+    // Submit the new requests and wait for at least one to complete
+    long ret = syscall(__NR_io_uring_enter, ring->fd, (unsigned)queued, 1,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      failed = 1; break;
+    }
+    queued -= (size_t)ret < queued ? (size_t)ret : queued;
+    depth_sum += inflight; ++samples;
+    if (inflight > stats->depth_max) stats->depth_max = inflight;
+    // Reap every completion posted so far
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      struct io_uring_cqe* cqe =
+        &((struct io_uring_cqe*)ring->cqes)[head & *ring->cq_mask];
+      size_t i = (size_t)cqe->user_data; int res = cqe->res;
+      aes128uring_buf_t* buf = &uring->bufs[i];
+      int opcode = buf->status == AES128URING_BUF_READING ?
+        IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      --inflight;
+      // A transient error or short transfer resubmits the remainder; EOF
+      // before the expected length means the file shrank underneath us
+      if (res > 0) buf->done += (size_t)res;
+      else if (res != -EAGAIN && res != -EINTR) failed = 1;
+      if (failed) {
+        buf->status = AES128URING_BUF_FREE; --busy; continue;
+      }
+      if (buf->done < buf->length) {
+        aes128uring_prep(uring, opcode, i); ++inflight; ++queued; continue;
+      }
+      if (buf->status == AES128URING_BUF_READING) {
+        // Hand the filled buffer to the next idle worker
+        pthread_mutex_lock(&uring->m);
+        buf->status = AES128URING_BUF_CRYPT;
+        uring->crypt_q[uring->crypt_tail++ % uring->depth] = i;
+        pthread_cond_signal(&uring->crypt_c);
+        pthread_mutex_unlock(&uring->m);
+      } else {
+        total += buf->length;
+        buf->status = AES128URING_BUF_FREE; --busy;
+      }
+    }
+    // Release the consumed completion entries back to the kernel
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  stats->depth_avg = samples > 0 ? depth_sum / samples : 0;
+  return failed ? 0 : (size_t)total;
+}
+
+void* aes128uring_target(void* arg) {
+  aes128uring_t* uring = (aes128uring_t*)arg;
+  for (;;) {
+    // Wait for the ring owner to hand over a completed read
+    pthread_mutex_lock(&uring->m);
+    while (!uring->stop && uring->crypt_head == uring->crypt_tail)
+      pthread_cond_wait(&uring->crypt_c, &uring->m);
+    if (uring->stop) {
+      pthread_mutex_unlock(&uring->m); break;
+    }
+    size_t i = uring->crypt_q[uring->crypt_head++ % uring->depth];
+    pthread_mutex_unlock(&uring->m);
+    // Crypt the buffer in place, including any trailing partial block
+    aes128uring_buf_t* buf = &uring->bufs[i];
+    aes128ctr_crypt_blocks(uring->nonce, uring->key, buf->offset >> 4,
+      buf->state, (buf->length + 15) >> 4);
+    // Queue the buffer for its write back to the same offset
+    pthread_mutex_lock(&uring->m);
+    uring->write_q[uring->write_tail++ % uring->depth] = i;
+    pthread_cond_signal(&uring->write_c);
+    pthread_mutex_unlock(&uring->m);
+  } return NULL;
+}
+#endif
@@ -0,0 +1,102 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES128URING_H
+#define __AES128URING_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128ctr.h"
+#include "aes128pool.h"
+
+// The engine talks to the kernel directly, so it needs the Linux UAPI header
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define AES128URING_AVAILABLE 1
+  #endif
+#endif
+#ifndef AES128URING_AVAILABLE
+  #define AES128URING_AVAILABLE 0
+#endif
+
+// Default number of registered buffers (and thus requests) kept in flight
+#ifndef AES128URING_DEPTH
+  #define AES128URING_DEPTH 32
+#endif
+
+// Largest queue depth accepted, matching the kernel's limit on ring entries
+#define AES128URING_MAX_DEPTH 32768
+
+// Stages a registered buffer moves through
+#define AES128URING_BUF_FREE    0
+#define AES128URING_BUF_READING 1
+#define AES128URING_BUF_CRYPT   2
+#define AES128URING_BUF_WRITING 3
+
+// The kernel-shared submission and completion rings
+typedef struct {
+  int                    fd;
+  uint32_t              *sq_head, *sq_tail, *sq_mask, *sq_array;
+  uint32_t              *cq_head, *cq_tail, *cq_mask;
+  void                  *sqes, *cqes;
+  void                  *sq_ring, *cq_ring;
+  size_t                 sq_size, cq_size, sqe_size;
+} aes128uring_ring_t;
+
+typedef struct {
+  int                    status;
+  uint64_t               offset;
+  size_t                 length, done;
+  aes128_state_t*        state;
+} aes128uring_buf_t;
+
+typedef struct {
+  aes128uring_ring_t     ring;
+  int                    fd;
+  const aes128_nonce_t*  nonce;
+  const aes128_key_t*    key;
+  aes128uring_buf_t*     bufs;
+  aes128pool_t           pool;
+  size_t                 depth, chunk;
+  // Buffers waiting for a worker, and crypted buffers waiting for a write
+  pthread_mutex_t        m;
+  pthread_cond_t         crypt_c, write_c;
+  size_t                *crypt_q, crypt_head, crypt_tail;
+  size_t                *write_q, write_head, write_tail;
+  volatile int           stop;
+} aes128uring_t;
+
+// What the engine achieved, for reporting by the caller
+typedef struct {
+  int                    fallback;
+  size_t                 depth, depth_max;
+  double                 depth_avg;
+  uint64_t               bytes;
+  double                 seconds;
+} aes128uring_stats_t;
+
+extern size_t aes128uring_crypt_path(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, const char* path,
+  const aes128ctr_config_t* config, aes128uring_stats_t* stats);
+
+#endif
@@ -0,0 +1,763 @@
+/**
+ * Copyright (C) 2017  Clay Freeman.
+ * This file is part of clayfreeman/aes.
+ *
+ * clayfreeman/aes is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * clayfreeman/aes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with clayfreeman/aes; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "aes.h"
+#include "aes128.h"
+#include "aes128bs.h"
+#include "aes128cache.h"
+#include "aes128ctr.h"
+#include "aes128ni.h"
+
+#define BENCH_BLOCKS 65536
+#define BENCH_TRIALS 8
+
+// Short messages, each with its own key and nonce, for the multi-stream API
+#define BENCH_MESSAGES      4096
+#define BENCH_MESSAGE_BYTES 64
+
+// Buffer sizes swept by the suite, stepping up by a factor of four
+#define BENCH_SUITE_MIN     16
+#define BENCH_SUITE_MAX     (64 << 20)
+
+// Timed trials per case and size, after untimed warmup runs; slow cases
+// stop warming up after one run and keep at least BENCH_SUITE_FLOOR trials
+// once they exceed their budget in seconds
+#define BENCH_SUITE_TRIALS  31
+#define BENCH_SUITE_WARMUP  2
+#define BENCH_SUITE_FLOOR   3
+#define BENCH_SUITE_BUDGET  0.25
+
+// Counter blocks checked on each side of every counter wrap point
+#define BENCH_WRAP_BLOCKS   5
+
+// Small buffers are crypted repeatedly until a trial covers this many bytes
+#define BENCH_SUITE_SPAN    (64 << 10)
+
+// Report formats of the suite
+#define BENCH_TEXT 0
+#define BENCH_CSV  1
+#define BENCH_JSON 2
+
+typedef void (*bench_encrypt_t)(const aes128_key_t*, aes128_state_t*);
+typedef void (*bench_keystream_t)(const aes128_nonce_t*, const aes128_key_t*,
+  uint64_t, aes128_state_t*, size_t);
+typedef void (*bench_op_t)(const aes128_nonce_t*, const aes128_key_t*,
+  uint8_t*, size_t);
+
+// One operation of the suite; cases without an engine of their own run on
+// every supported engine in turn
+typedef struct {
+  const char*            name;
+  const char*            engine;
+  bench_op_t             op;
+} bench_case_t;
+
+typedef struct {
+  size_t                 max, trials, warmup;
+  int                    format;
+} bench_options_t;
+
+// Cycles per byte at the minimum and the 50th, 90th and 99th percentiles,
+// and the median throughput
+typedef struct {
+  const char*            name;
+  const char*            engine;
+  size_t                 bytes, trials;
+  double                 cpb[4], gbps;
+} bench_result_t;
+
+uint64_t bench_ticks(void);
+int bench_verify_wraps(const aes128_key_t* key);
+int bench_verify_nonces(const aes128_nonce_t* nonce, const aes128_key_t* key);
+double bench_engine(const char* name, bench_encrypt_t encrypt,
+  const aes128_key_t* key, aes128_state_t* state, size_t blocks);
+double bench_keystream(const char* name, bench_keystream_t keystream,
+  const aes128_nonce_t* nonce, const aes128_key_t* key,
+  aes128_state_t* state, size_t blocks);
+double bench_ctr(const char* name, size_t batch, const aes128_nonce_t* nonce,
+  const aes128_key_t* key, aes128_state_t* state, size_t blocks);
+double bench_messages(const char* name, int batched,
+  aes128ctr_message_t* messages, size_t count);
+double bench_schedules(const char* name, aes128cache_t* cache,
+  const aes128_key_t* keys, size_t count);
+#if AES128BS_AVAILABLE
+  int bench_verify_bs_cache(aes128cache_t* cache,
+    const aes128_nonce_t* nonce, const aes128_key_t* keys, size_t count);
+  double bench_bs_schedules(const char* name, aes128cache_t* cache,
+    const aes128_nonce_t* nonce, const aes128_key_t* keys, size_t count);
+#endif
+int bench_suite(const bench_options_t* options, const aes128_nonce_t* nonce,
+  const aes128_key_t* key);
+int bench_measure(const bench_case_t* bench, const bench_options_t* options,
+  const aes128_nonce_t* nonce, const aes128_key_t* key, uint8_t* data,
+  size_t bytes, bench_result_t* result);
+void bench_report(const bench_result_t* result, int format, int first);
+double bench_seconds(void);
+double bench_percentile(const double* sorted, size_t count, double p);
+int bench_compare(const void* a, const void* b);
+int bench_parse(const char* text, size_t* value);
+void bench_usage(const char* name);
+void bench_op_key_init(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_add_round_key(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint8_t* data, size_t bytes);
+void bench_op_sbox(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_shift_cols(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_mix_rows(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_encrypt_bytes(const aes128_nonce_t* nonce,
+  const aes128_key_t* key, uint8_t* data, size_t bytes);
+void bench_op_encrypt(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_ctr_block(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+void bench_op_ctr_buffer(const aes128_nonce_t* nonce, const aes128_key_t* key,
+  uint8_t* data, size_t bytes);
+
+static const struct option bench_long_options[] = {
+  {"format",      required_argument, NULL, 'f'},
+  {"help",        no_argument,       NULL, 'h'},
+  {"max",         required_argument, NULL, 'm'},
+  {"suite",       no_argument,       NULL, 's'},
+  {"trials",      required_argument, NULL, 't'},
+  {"warmup",      required_argument, NULL, 'w'},
+  {NULL,          0,                 NULL,  0 }
+};
+
+// The byte-engine round steps come first, then everything per engine
+static const bench_case_t bench_cases[] = {
+  {"add-round-key", "bytes", bench_op_add_round_key},
+  {"sbox",          "bytes", bench_op_sbox},
+  {"shift-cols",    "bytes", bench_op_shift_cols},
+  {"mix-rows",      "bytes", bench_op_mix_rows},
+  {"encrypt",       "bytes", bench_op_encrypt_bytes},
+  {"key-init",      NULL,    bench_op_key_init},
+  {"encrypt",       NULL,    bench_op_encrypt},
+  {"ctr-block",     NULL,    bench_op_ctr_block},
+  {"ctr-buffer",    NULL,    bench_op_ctr_buffer}
+};
+
+int main(int argc, char* argv[]) {
+  bench_options_t options = {BENCH_SUITE_MAX, BENCH_SUITE_TRIALS,
+    BENCH_SUITE_WARMUP, BENCH_TEXT};
+  int use_suite = 0;
+  for (int opt; (opt = getopt_long(argc, argv, "f:hm:st:w:",
+      bench_long_options, NULL)) != -1;)
+    switch (opt) {
+      case 's': use_suite = 1; break;
+      case 'f':
+        if (strcmp(optarg, "text") == 0)      options.format = BENCH_TEXT;
+        else if (strcmp(optarg, "csv") == 0)  options.format = BENCH_CSV;
+        else if (strcmp(optarg, "json") == 0) options.format = BENCH_JSON;
+        else {
+          fprintf(stderr, "error: --format must be text, csv or json\n");
+          bench_usage(argv[0]);
+          return 1;
+        } break;
+      case 'm': case 't': case 'w':
+        if (!bench_parse(optarg, opt == 'm' ? &options.max : opt == 't' ?
+            &options.trials : &options.warmup) || (opt == 'm' &&
+            options.max < BENCH_SUITE_MIN)) {
+          fprintf(stderr, "error: -%c must be a positive integer%s\n", opt,
+            opt == 'm' ? " of at least 16" : "");
+          bench_usage(argv[0]);
+          return 1;
+        } break;
+      default:
+        bench_usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  aes128_key_t    key;
+  aes128_state_t* ref   = malloc(BENCH_BLOCKS * sizeof(aes128_state_t));
+  aes128_state_t* state = malloc(BENCH_BLOCKS * sizeof(aes128_state_t));
+  if (ref == NULL || state == NULL) {
+    perror("bench: malloc()");
+    return 1;
+  }
+  // Use a fixed key and a deterministic plaintext so runs are comparable
+  for (size_t i = 0; i < sizeof(key.val); ++i) key.val[i] = (uint8_t)i;
+  aes128_key_init(&key);
+  for (size_t i = 0; i < BENCH_BLOCKS; ++i)
+    for (size_t j = 0; j < sizeof(ref[i].val); ++j)
+      ref[i].val[j] = (uint8_t)(i * 31 + j);
+  // Verify that every engine agrees with the reference engine first
+  memcpy(state, ref, BENCH_BLOCKS * sizeof(aes128_state_t));
+  for (size_t i = 0; i < BENCH_BLOCKS; ++i) {
+    aes128_encrypt_bytes (&key, &ref[i]);
+    aes128_encrypt_ttable(&key, &state[i]);
+  }
+  if (memcmp(ref, state, BENCH_BLOCKS * sizeof(aes128_state_t)) != 0) {
+    fprintf(stderr, "error: T-table engine does not match byte engine\n");
+    return 2;
+  }
+  // Verify that every engine produces the same key stream
+  aes128_nonce_t nonce = {{0}};
+  aes128_ctr_keystream(&nonce, &key, 0, ref, BENCH_BLOCKS);
+  for (int i = 0; i < AES128_ENGINE_COUNT; ++i) {
+    if (!aes128_engine_select((aes128_engine_t)i)) continue;
+    aes128ctr_keystream(&nonce, &key, 0, state, BENCH_BLOCKS);
+    if (memcmp(ref, state, BENCH_BLOCKS * sizeof(aes128_state_t)) != 0) {
+      fprintf(stderr, "error: %s key stream does not match\n",
+        aes128_engine_name((aes128_engine_t)i));
+      return 2;
+    }
+  }
+  if (!bench_verify_wraps(&key) || !bench_verify_nonces(&nonce, &key))
+    return 2;
+  // The suite sweeps every case over a range of buffer sizes instead
+  if (use_suite) {
+    free(ref); free(state);
+    return bench_suite(&options, &nonce, &key);
+  }
+  // Time each engine over the same buffer
+  bench_engine("bytes",  aes128_encrypt_bytes,  &key, state, BENCH_BLOCKS);
+  bench_engine("ttable", aes128_encrypt_ttable, &key, state, BENCH_BLOCKS);
+  bench_keystream("soft-ctr", aes128_ctr_keystream,
+    &nonce, &key, state, BENCH_BLOCKS);
+  #if AES128BS_AVAILABLE
+    if (aes128_engine_supported(AES128_ENGINE_BITSLICE))
+      bench_keystream("bs-ctr", aes128bs_ctr_keystream,
+        &nonce, &key, state, BENCH_BLOCKS);
+  #endif
+  #if AES128NI_AVAILABLE
+    if (aes128_engine_supported(AES128_ENGINE_AESNI)) {
+      bench_engine("aesni", aes128ni_encrypt, &key, state, BENCH_BLOCKS);
+      bench_keystream("aesni-ctr", aes128ni_ctr_keystream,
+        &nonce, &key, state, BENCH_BLOCKS);
+    }
+    if (aes128_engine_supported(AES128_ENGINE_VAES))
+      bench_keystream("vaes-ctr", aes128ni_ctr_keystream_vaes,
+        &nonce, &key, state, BENCH_BLOCKS);
+  #endif
+  // Give every short message its own key, nonce and slice of the buffer
+  aes128_key_t*        keys     = calloc(BENCH_MESSAGES, sizeof(*keys));
+  aes128_nonce_t*      nonces   = calloc(BENCH_MESSAGES, sizeof(*nonces));
+  aes128ctr_message_t* messages = calloc(BENCH_MESSAGES, sizeof(*messages));
+  uint8_t* data = malloc(2 * BENCH_MESSAGES * BENCH_MESSAGE_BYTES);
+  if (keys == NULL || nonces == NULL || messages == NULL || data == NULL) {
+    perror("bench: malloc()");
+    return 1;
+  }
+  for (size_t i = 0; i < BENCH_MESSAGES; ++i) {
+    for (size_t j = 0; j < sizeof(keys[i].val) && j < 16; ++j)
+      keys[i].val[j] = (uint8_t)(i * 7 + j);
+    aes128_key_init(&keys[i]);
+    memcpy(nonces[i].val, &i, sizeof(nonces[i].val));
+    messages[i].key    = &keys[i];  messages[i].nonce  = &nonces[i];
+    messages[i].length = BENCH_MESSAGE_BYTES;
+  }
+  // Compare the per-block CTR path against batches on every engine
+  for (int i = 0; i < AES128_ENGINE_COUNT; ++i) {
+    if (!aes128_engine_select((aes128_engine_t)i)) continue;
+    const char* name = aes128_engine_name((aes128_engine_t)i);
+    printf("[%s]\n", name);
+    bench_ctr("per-block",  1, &nonce, &key, state, BENCH_BLOCKS);
+    bench_ctr("batch-4",    4, &nonce, &key, state, BENCH_BLOCKS);
+    bench_ctr("batch-8",    8, &nonce, &key, state, BENCH_BLOCKS);
+    bench_ctr("batch-16",  16, &nonce, &key, state, BENCH_BLOCKS);
+    // Check that interleaving messages matches crypting them one by one
+    uint8_t* copy = data + BENCH_MESSAGES * BENCH_MESSAGE_BYTES;
+    memset(data, 0, 2 * BENCH_MESSAGES * BENCH_MESSAGE_BYTES);
+    for (size_t j = 0; j < BENCH_MESSAGES; ++j)
+      messages[j].data = data + j * BENCH_MESSAGE_BYTES;
+    bench_messages(NULL, 0, messages, BENCH_MESSAGES);
+    for (size_t j = 0; j < BENCH_MESSAGES; ++j)
+      messages[j].data = copy + j * BENCH_MESSAGE_BYTES;
+    bench_messages(NULL, 1, messages, BENCH_MESSAGES);
+    if (memcmp(data, copy, BENCH_MESSAGES * BENCH_MESSAGE_BYTES) != 0) {
+      fprintf(stderr, "error: %s multi-stream key stream does not match\n",
+        name);
+      return 2;
+    }
+    bench_messages("msg-loop",  0, messages, BENCH_MESSAGES);
+    bench_messages("msg-multi", 1, messages, BENCH_MESSAGES);
+  }
+  // Compare expanding each message's key against a warm schedule cache
+  aes128cache_t cache;
+  if (!aes128cache_init(&cache, BENCH_MESSAGES)) {
+    perror("bench: aes128cache_init()");
+    return 1;
+  }
+  bench_schedules(NULL,        &cache, keys, BENCH_MESSAGES);
+  bench_schedules("key-init",  NULL,   keys, BENCH_MESSAGES);
+  bench_schedules("key-cache", &cache, keys, BENCH_MESSAGES);
+  #if AES128BS_AVAILABLE
+    // Compare slicing each message's key into bit planes against taking
+    // the planes from the cache
+    if (aes128_engine_supported(AES128_ENGINE_BITSLICE)) {
+      if (!bench_verify_bs_cache(&cache, &nonce, keys, BENCH_MESSAGES))
+        return 2;
+      bench_bs_schedules("bs-slice", NULL,   &nonce, keys, BENCH_MESSAGES);
+      bench_bs_schedules("bs-cache", &cache, &nonce, keys, BENCH_MESSAGES);
+    }
+  #endif
+  aes128cache_destroy(&cache);
+  free(ref); free(state);
+  free(keys); free(nonces); free(messages); free(data);
+  return 0;
+}
+
+int bench_verify_nonces(const aes128_nonce_t* nonce,
+    const aes128_key_t* key) {
+  const char* labels[] = {"", "a", "dir/file.txt"};
+  aes128_nonce_t derived; aes128_state_t block;
+  for (size_t i = 0; i < sizeof(labels) / sizeof(*labels); ++i) {
+    // The first MAC block has the layout of counter block strlen(label)
+    // under the base nonce, so its key stream must not leak out as the nonce
+    const size_t length = strlen(labels[i]);
+    aes128ctr_derive_nonce(nonce, key, labels[i], &derived);
+    aes128ctr_keystream(nonce, key, length, &block, 1);
+    if (memcmp(derived.val, block.val, sizeof(derived.val)) == 0) {
+      fprintf(stderr, "error: nonce derived from \"%s\" is key stream of "
+        "the base nonce\n", labels[i]);
+      return 0;
+    }
+  } return 1;
+}
+
+int bench_verify_wraps(const aes128_key_t* key) {
+  // Each run ends just after the low counter byte, the low counter word or
+  // the whole counter wraps, where the soft engine refreshes its cache
+  const uint64_t wraps[] = {0x100, (uint64_t)1 << 32, 0};
+  const aes128_nonce_t nonce = {{0xF0, 0xE1, 0xD2, 0xC3,
+    0xB4, 0xA5, 0x96, 0x87}};
+  aes128_state_t ref[2 * BENCH_WRAP_BLOCKS], state[2 * BENCH_WRAP_BLOCKS];
+  for (size_t w = 0; w < sizeof(wraps) / sizeof(*wraps); ++w) {
+    const uint64_t counter = wraps[w] - BENCH_WRAP_BLOCKS;
+    // Build every counter block by hand and run it through the byte engine
+    for (size_t i = 0; i < 2 * BENCH_WRAP_BLOCKS; ++i) {
+      memcpy(ref[i].val, nonce.val, sizeof(nonce.val));
+      for (uint8_t j = 0; j < 8; ++j)
+        ref[i].val[8 + j] = (uint8_t)((counter + i) >> (56 - (j << 3)));
+      aes128_encrypt_bytes(key, &ref[i]);
+    }
+    for (int i = 0; i < AES128_ENGINE_COUNT; ++i) {
+      if (!aes128_engine_select((aes128_engine_t)i)) continue;
+      aes128ctr_keystream(&nonce, key, counter, state,
+        2 * BENCH_WRAP_BLOCKS);
+      if (memcmp(ref, state, sizeof(ref)) != 0) {
+        fprintf(stderr, "error: %s key stream does not match across "
+          "counter 0x%016lx\n", aes128_engine_name((aes128_engine_t)i),
+          (unsigned long)wraps[w]);
+        return 0;
+      }
+    }
+  } return 1;
+}
+
+uint64_t bench_ticks(void) {
+  #if defined(__x86_64__) || defined(__i386__)
+    // Use the time stamp counter to report cycles directly
+    return __rdtsc();
+  #else
+    // Otherwise fall back to nanoseconds as an approximation
+    struct timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  #endif
+}
+
+double bench_engine(const char* name, bench_encrypt_t encrypt,
+    const aes128_key_t* key, aes128_state_t* state, size_t blocks) {
+  uint64_t best = UINT64_MAX;
+  // Keep the fastest of several trials to filter out scheduling noise
+  for (size_t trial = 0; trial < BENCH_TRIALS; ++trial) {
+    uint64_t start = bench_ticks();
+    for (size_t i = 0; i < blocks; ++i)
+      encrypt(key, &state[i]);
+    uint64_t ticks = bench_ticks() - start;
+    if (ticks < best) best = ticks;
+  }
+  double cpb = best / (double)(blocks << 4);
+  printf("%-10s %10.2f cycles/byte\n", name, cpb);
+  return cpb;
+}
+
+double bench_keystream(const char* name, bench_keystream_t keystream,
+    const aes128_nonce_t* nonce, const aes128_key_t* key,
+    aes128_state_t* state, size_t blocks) {
+  uint64_t best = UINT64_MAX;
+  // Keep the fastest of several trials to filter out scheduling noise
+  for (size_t trial = 0; trial < BENCH_TRIALS; ++trial) {
+    uint64_t start = bench_ticks();
+    keystream(nonce, key, 0, state, blocks);
+    uint64_t ticks = bench_ticks() - start;
+    if (ticks < best) best = ticks;
+  }
+  double cpb = best / (double)(blocks << 4);
+  printf("%-10s %10.2f cycles/byte\n", name, cpb);
+  return cpb;
+}
+
+double bench_messages(const char* name, int batched,
+    aes128ctr_message_t* messages, size_t count) {
+  uint64_t best = UINT64_MAX; size_t bytes = 0;
+  // Keep the fastest of several trials to filter out scheduling noise; a
+  // NULL name runs once without reporting
+  for (size_t trial = 0; trial < (name == NULL ? 1 : BENCH_TRIALS); ++trial) {
+    uint64_t start = bench_ticks(); bytes = 0;
+    // Unbatched, each message is crypted one block at a time in turn
+    if (batched)
+      aes128ctr_crypt_messages(messages, count);
+    else
+      for (size_t i = 0; i < count; ++i)
+        for (size_t j = 0; j < messages[i].length; j += 16)
+          aes128ctr_crypt(messages[i].nonce, messages[i].key,
+            (aes128_state_t*)(messages[i].data + j),
+            messages[i].counter + (j >> 4));
+    uint64_t ticks = bench_ticks() - start;
+    if (ticks < best) best = ticks;
+  }
+  for (size_t i = 0; i < count; ++i)
+    bytes += messages[i].length;
+  double cpb = best / (double)bytes;
+  if (name != NULL) printf("%-10s %10.2f cycles/byte\n", name, cpb);
+  return cpb;
+}
+
+double bench_schedules(const char* name, aes128cache_t* cache,
+    const aes128_key_t* keys, size_t count) {
+  uint64_t best = UINT64_MAX; aes128_key_t key;
+  // The first round key of each schedule is its raw key; a NULL name only
+  // warms the cache
+  for (size_t trial = 0; trial < (name == NULL ? 1 : BENCH_TRIALS); ++trial) {
+    uint64_t start = bench_ticks();
+    for (size_t i = 0; i < count; ++i)
+      if (cache != NULL)
+        aes128cache_get(cache, keys[i].val, &key);
+      else {
+        memcpy(key.val, keys[i].val, 16); aes128_key_init(&key);
+      }
+    uint64_t ticks = bench_ticks() - start;
+    if (ticks < best) best = ticks;
+  }
+  double cpk = best / (double)count;
+  if (name != NULL) printf("%-10s %10.2f cycles/key\n", name, cpk);
+  return cpk;
+}
+
+#if AES128BS_AVAILABLE
+  int bench_verify_bs_cache(aes128cache_t* cache,
+      const aes128_nonce_t* nonce, const aes128_key_t* keys, size_t count) {
+    aes128_state_t ref[AES128BS_LANES_AVX2], state[AES128BS_LANES_AVX2];
+    aes128_key_t key; aes128bs_key_t bs_key;
+    for (size_t i = 0; i < count; ++i) {
+      // Cached planes must give the same key stream as the table engine,
+      // including the tail left over after the sliced lane groups
+      const size_t blocks = AES128BS_LANES_AVX2 - i % AES128BS_LANES_SSSE3;
+      aes128cache_get_bs(cache, keys[i].val, &key, &bs_key);
+      aes128bs_ctr_keystream_keyed(nonce, &key, &bs_key, i, state, blocks);
+      aes128_ctr_keystream(nonce, &keys[i], i, ref, blocks);
+      if (memcmp(ref, state, blocks * sizeof(*state)) != 0) {
+        fprintf(stderr, "error: cached bit planes of key %zu do not match\n",
+          i);
+        return 0;
+      }
+    } return 1;
+  }
+
+  double bench_bs_schedules(const char* name, aes128cache_t* cache,
+      const aes128_nonce_t* nonce, const aes128_key_t* keys, size_t count) {
+    uint64_t best = UINT64_MAX; aes128_key_t key; aes128bs_key_t bs_key;
+    aes128_state_t state[AES128BS_LANES_AVX2];
+    // Each message fills one wide lane group under its own key, which the
+    // uncached path slices into bit planes again every time
+    for (size_t trial = 0; trial < BENCH_TRIALS; ++trial) {
+      uint64_t start = bench_ticks();
+      for (size_t i = 0; i < count; ++i)
+        if (cache != NULL) {
+          aes128cache_get_bs(cache, keys[i].val, &key, &bs_key);
+          aes128bs_ctr_keystream_keyed(nonce, &key, &bs_key, 0, state,
+            AES128BS_LANES_AVX2);
+        } else
+          aes128bs_ctr_keystream(nonce, &keys[i], 0, state,
+            AES128BS_LANES_AVX2);
+      uint64_t ticks = bench_ticks() - start;
+      if (ticks < best) best = ticks;
+    }
+    double cpb = best / (double)(count * sizeof(state));
+    printf("%-10s %10.2f cycles/byte\n", name, cpb);
+    return cpb;
+  }
+#endif
+
+double bench_ctr(const char* name, size_t batch, const aes128_nonce_t* nonce,
+    const aes128_key_t* key, aes128_state_t* state, size_t blocks) {
+  uint64_t best = UINT64_MAX;
+  // Keep the fastest of several trials to filter out scheduling noise
+  for (size_t trial = 0; trial < BENCH_TRIALS; ++trial) {
+    uint64_t start = bench_ticks();
+    // A batch size of one exercises the original one-call-per-block path
+    if (batch == 1)
+      for (size_t i = 0; i < blocks; ++i)
+        aes128ctr_crypt(nonce, key, &state[i], i);
+    else
+      for (size_t i = 0; i < blocks; i += batch)
+        aes128ctr_crypt_blocks(nonce, key, i, &state[i], batch);
+    uint64_t ticks = bench_ticks() - start;
+    if (ticks < best) best = ticks;
+  }
+  double cpb = best / (double)(blocks << 4);
+  printf("%-10s %10.2f cycles/byte\n", name, cpb);
+  return cpb;
+}
+
+int bench_suite(const bench_options_t* options, const aes128_nonce_t* nonce,
+    const aes128_key_t* key) {
+  const aes128_engine_t initial = aes128_engine(); int first = 1;
+  size_t engines = 0;
+  const size_t count = sizeof(bench_cases) / sizeof(*bench_cases);
+  uint8_t* data = malloc(options->max);
+  if (data == NULL) {
+    perror("bench: malloc()");
+    return 1;
+  }
+  // Fault in the whole buffer before anything is timed
+  for (size_t i = 0; i < options->max; ++i) data[i] = (uint8_t)(i * 31);
+  if (options->format == BENCH_TEXT)
+    printf("%-14s %-8s %10s %6s %8s %8s %8s %8s %8s\n", "case", "engine",
+      "bytes", "trials", "cpb-min", "cpb-p50", "cpb-p90", "cpb-p99",
+      "GB/s");
+  else if (options->format == BENCH_CSV)
+    printf("case,engine,bytes,trials,cpb_min,cpb_p50,cpb_p90,cpb_p99,"
+      "gbps_p50\n");
+  else
+    printf("[");
+  for (int i = 0; i < AES128_ENGINE_COUNT; ++i) {
+    if (!aes128_engine_select((aes128_engine_t)i)) continue;
+    for (size_t j = 0; j < count; ++j) {
+      const bench_case_t* bench = &bench_cases[j];
+      // Engine-independent cases only run once, on the first engine
+      if (bench->engine != NULL && engines > 0) continue;
+      for (size_t bytes = BENCH_SUITE_MIN; bytes <= options->max;
+          bytes <<= 2) {
+        bench_result_t result;
+        if (!bench_measure(bench, options, nonce, key, data, bytes,
+            &result)) {
+          perror("bench: malloc()");
+          free(data); return 1;
+        }
+        bench_report(&result, options->format, first);
+        first = 0;
+      }
+    }
+    ++engines;
+  }
+  if (options->format == BENCH_JSON) printf("\n]\n");
+  aes128_engine_select(initial);
+  free(data);
+  return 0;
+}
+
+int bench_measure(const bench_case_t* bench, const bench_options_t* options,
+    const aes128_nonce_t* nonce, const aes128_key_t* key, uint8_t* data,
+    size_t bytes, bench_result_t* result) {
+  const size_t reps = bytes < BENCH_SUITE_SPAN ? BENCH_SUITE_SPAN / bytes : 1;
+  const double total = (double)bytes * reps;
+  double* cpb  = malloc(options->trials * sizeof(*cpb));
+  double* gbps = malloc(options->trials * sizeof(*gbps));
+  if (cpb == NULL || gbps == NULL) {
+    free(cpb); free(gbps); return 0;
+  }
+  // Warm the caches, branch predictors and key schedule without timing
+  double start = bench_seconds(), run = 0;
+  for (size_t i = 0; i < options->warmup; ++i) {
+    for (size_t r = 0; r < reps; ++r)
+      bench->op(nonce, key, data, bytes);
+    run = (bench_seconds() - start) / (i + 1);
+    if (run > BENCH_SUITE_BUDGET) break;
+  }
+  // Cut the trials of slow cases short to stay within the time budget
+  size_t trials = options->trials;
+  if (run * trials > BENCH_SUITE_BUDGET) {
+    trials = (size_t)(BENCH_SUITE_BUDGET / run);
+    if (trials < BENCH_SUITE_FLOOR)  trials = BENCH_SUITE_FLOOR;
+    if (trials > options->trials)    trials = options->trials;
+  }
+  for (size_t t = 0; t < trials; ++t) {
+    double seconds = bench_seconds(); uint64_t ticks = bench_ticks();
+    for (size_t r = 0; r < reps; ++r)
+      bench->op(nonce, key, data, bytes);
+    ticks = bench_ticks() - ticks; seconds = bench_seconds() - seconds;
+    cpb[t]  = ticks / total;
+    gbps[t] = seconds > 0 ? total / seconds / 1e9 : 0;
+  }
+  // Report the spread over trials, not just the best of them
+  qsort(cpb,  trials, sizeof(*cpb),  bench_compare);
+  qsort(gbps, trials, sizeof(*gbps), bench_compare);
+  result->name   = bench->name;
+  result->engine = bench->engine != NULL ? bench->engine :
+    aes128_engine_name(aes128_engine());
+  result->bytes  = bytes;      result->trials = trials;
+  result->cpb[0] = cpb[0];
+  result->cpb[1] = bench_percentile(cpb, trials, 50);
+  result->cpb[2] = bench_percentile(cpb, trials, 90);
+  result->cpb[3] = bench_percentile(cpb, trials, 99);
+  result->gbps   = bench_percentile(gbps, trials, 50);
+  free(cpb); free(gbps);
+  return 1;
+}
+
+void bench_report(const bench_result_t* result, int format, int first) {
+  const double* cpb = result->cpb;
+  if (format == BENCH_TEXT)
+    printf("%-14s %-8s %10lu %6lu %8.2f %8.2f %8.2f %8.2f %8.3f\n",
+      result->name, result->engine, result->bytes, result->trials, cpb[0],
+      cpb[1], cpb[2], cpb[3], result->gbps);
+  else if (format == BENCH_CSV)
+    printf("%s,%s,%lu,%lu,%.3f,%.3f,%.3f,%.3f,%.4f\n", result->name,
+      result->engine, result->bytes, result->trials, cpb[0], cpb[1], cpb[2],
+      cpb[3], result->gbps);
+  else
+    printf("%s\n  {\"case\": \"%s\", \"engine\": \"%s\", \"bytes\": %lu, "
+      "\"trials\": %lu, \"cpb_min\": %.3f, \"cpb_p50\": %.3f, \"cpb_p90\": "
+      "%.3f, \"cpb_p99\": %.3f, \"gbps_p50\": %.4f}", first ? "" : ",",
+      result->name, result->engine, result->bytes, result->trials, cpb[0],
+      cpb[1], cpb[2], cpb[3], result->gbps);
+  fflush(stdout);
+}
+
+double bench_seconds(void) {
+  struct timespec now = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+double bench_percentile(const double* sorted, size_t count, double p) {
+  // Use the nearest rank, so that every reported value was observed
+  size_t rank = (size_t)(p / 100 * count + 0.999999);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+int bench_compare(const void* a, const void* b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+int bench_parse(const char* text, size_t* value) {
+  char* end = NULL; errno = 0;
+  // Accept only a positive decimal integer with nothing trailing it
+  unsigned long long parsed = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || *end != 0 || parsed == 0) return 0;
+  *value = (size_t)parsed;
+  return 1;
+}
+
+void bench_usage(const char* name) {
+  fprintf(stderr, "\nUsage: %s [options]\n"
+                  "\nWithout --suite, prints a short comparison of the "
+                  "engines at one size.\n"
+                  "\nOptions:\n"
+                  "  -s, --suite          sweep every case over buffers "
+                  "from 16 bytes up\n"
+                  "  -f, --format=FORMAT  report as text, csv or json "
+                  "(default text)\n"
+                  "  -m, --max=BYTES      largest buffer of the sweep "
+                  "(default %d)\n"
+                  "  -t, --trials=N       timed trials per case and size "
+                  "(default %d)\n"
+                  "  -w, --warmup=N       untimed runs before the trials "
+                  "(default %d)\n"
+                  "  -h, --help           show this message\n",
+                  name, BENCH_SUITE_MAX, BENCH_SUITE_TRIALS,
+                  BENCH_SUITE_WARMUP);
+}
+
+void bench_op_key_init(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_key_t expanded; (void)nonce; (void)key;
+  // Expand a schedule from every 16 bytes of the buffer, feeding a byte of
+  // each back in so that no expansion can be skipped
+  for (size_t i = 0; i < bytes; i += 16) {
+    memcpy(expanded.val, data + i, 16); aes128_key_init(&expanded);
+    data[i] ^= expanded.val[sizeof(expanded.val) - 1];
+  }
+}
+
+void bench_op_add_round_key(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_add_round_key(&state[i], &state[i], key, 1);
+}
+
+void bench_op_sbox(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce; (void)key;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_sbox_repl(&state[i], &state[i]);
+}
+
+void bench_op_shift_cols(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce; (void)key;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_shift_cols(&state[i], &state[i]);
+}
+
+void bench_op_mix_rows(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce; (void)key;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_mix_rows(&state[i], &state[i]);
+}
+
+void bench_op_encrypt_bytes(const aes128_nonce_t* nonce,
+    const aes128_key_t* key, uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_encrypt_bytes(key, &state[i]);
+}
+
+void bench_op_encrypt(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data; (void)nonce;
+  // One call per block through the engine dispatch
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128_encrypt(key, &state[i]);
+}
+
+void bench_op_ctr_block(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  aes128_state_t* state = (aes128_state_t*)data;
+  for (size_t i = 0; i < bytes >> 4; ++i)
+    aes128ctr_crypt(nonce, key, &state[i], i);
+}
+
+void bench_op_ctr_buffer(const aes128_nonce_t* nonce, const aes128_key_t* key,
+    uint8_t* data, size_t bytes) {
+  // The batched key stream of the selected engine
+  aes128ctr_crypt_inplace(nonce, key, 0, data, bytes);
+}
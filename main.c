@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,45 +33,242 @@
 
 #include "aes.h"
 #include "aes128.h"
+#include "aes128batch.h"
 #include "aes128ctr.h"
+#include "aes128trace.h"
+#include "aes128tune.h"
+#include "aes128uring.h"
 
 size_t          size;
 aes128_nonce_t  nonce;
 aes128_key_t    key;
 
-#ifndef AES128CTR_WORKER_COUNT
-  #define AES128CTR_WORKER_COUNT 8
-#endif
+static const struct option long_options[] = {
+  {"autotune",    no_argument,       NULL, 'a'},
+  {"batch",       no_argument,       NULL, 'B'},
+  {"blocks",      required_argument, NULL, 'b'},
+  {"direct",      no_argument,       NULL, 'd'},
+  {"help",        no_argument,       NULL, 'h'},
+  {"length",      required_argument, NULL, 'l'},
+  {"manifest",    required_argument, NULL, 'M'},
+  {"mmap",        no_argument,       NULL, 'm'},
+  {"nonces",      required_argument, NULL, 'N'},
+  {"offset",      required_argument, NULL, 'o'},
+  {"output",      required_argument, NULL, 'O'},
+  {"pread",       no_argument,       NULL, 'p'},
+  {"queue-depth", required_argument, NULL, 'q'},
+  {"shard",       required_argument, NULL, 's'},
+  {"stats",       optional_argument, NULL, 'S'},
+  {"threads",     required_argument, NULL, 't'},
+  {"trace",       required_argument, NULL, 'T'},
+  {"uring",       no_argument,       NULL, 'u'},
+  {NULL,          0,                 NULL,  0 }
+};
 
+int crypt_batch(const char* list, const char* nonces,
+  const aes128ctr_config_t* config);
+int parse_bytes(const char* text, uint64_t* value);
+int parse_count(const char* text, size_t* value);
+int parse_shard(const char* text, size_t* index, size_t* count);
+void print_stats(const aes128ctr_stats_t* stats, size_t bytes, int json);
+void print_thread_stats(const char* name,
+  const aes128ctr_thread_stats_t* stats, int json);
 void timespec_diff(const struct timespec* start, struct timespec* end);
 void usage(int argc, char* argv[]);
+int write_manifest(const char* path, const char* file, size_t index,
+  size_t count, uint64_t offset, size_t bytes, double seconds);
 
 int main(int argc, char* argv[]) {
-  FILE* fp = NULL;
+  FILE* fp = NULL; int use_autotune = 0;
+  int use_direct = 0, use_mmap = 0, use_pread = 0, use_uring = 0;
+  int use_range = 0; uint64_t offset = 0, length = UINT64_MAX;
+  size_t shard_index = 0, shard_count = 0; const char* manifest = NULL;
+  char manifest_path[4096]; const char* output = NULL;
+  int use_stream = 0, stream_ok = 0; uint64_t streamed = 0; struct stat st;
+  int use_batch = 0; const char* nonces = NULL;
+  int use_stats = 0, stats_json = 0; aes128ctr_stats_t stats;
+  aes128ctr_config_t config, cli = {0, 0, 0, 0};
+  aes128tune_profile_t profile; aes128uring_stats_t uring_stats;
+  char profile_path[4096];
+  memset(&stats, 0, sizeof(stats));
+  // Start from the host-derived defaults and any environment overrides
+  aes128ctr_config_init(&config);
+  // Consume any options preceding the positional arguments
+  for (int opt; (opt = getopt_long(argc, argv, "aBb:dhl:M:mN:O:o:pq:S::s:T:t:u",
+      long_options, NULL)) != -1;)
+    switch (opt) {
+      case 'a': use_autotune = 1; break;
+      case 'B': use_batch  = 1; break;
+      case 'N': nonces     = optarg; break;
+      case 'd': use_direct = 1; break;
+      case 'm': use_mmap   = 1; break;
+      case 'p': use_pread  = 1; break;
+      case 'u': use_uring  = 1; break;
+      case 'l': case 'o':
+        if (!parse_bytes(optarg, opt == 'l' ? &length : &offset) ||
+            length == 0) {
+          fprintf(stderr, "error: -%c must be a byte count%s\n", opt,
+            opt == 'l' ? " above zero" : "");
+          usage(argc, argv);
+          return 1;
+        }
+        use_range = 1; break;
+      case 'M': manifest = optarg; break;
+      case 'O': output   = optarg; break;
+      case 'T':
+        // Record chunk events from here on and write them out at exit
+        if (!aes128trace_start(optarg)) {
+          fprintf(stderr, "error: Could not start tracing to %s\n", optarg);
+          return 1;
+        } break;
+      case 'S':
+        use_stats  = 1;
+        stats_json = optarg != NULL && strcmp(optarg, "json") == 0;
+        if (optarg != NULL && !stats_json && strcmp(optarg, "text") != 0) {
+          fprintf(stderr, "error: --stats must be \"text\" or \"json\"\n");
+          usage(argc, argv);
+          return 1;
+        } break;
+      case 's':
+        if (!parse_shard(optarg, &shard_index, &shard_count)) {
+          fprintf(stderr, "error: -s must be I/N with 0 <= I < N\n");
+          usage(argc, argv);
+          return 1;
+        } break;
+      case 'b': case 'q': case 't':
+        if (!parse_count(optarg, opt == 'b' ? &cli.blocks :
+            opt == 'q' ? &cli.depth : &cli.threads)) {
+          fprintf(stderr, "error: -%c must be a positive integer\n", opt);
+          usage(argc, argv);
+          return 1;
+        } break;
+      default:
+        usage(argc, argv);
+        return opt == 'h' ? 0 : 1;
+    }
+  // Calibrate this host on request, or reuse the profile of an earlier run
+  int have_path = aes128tune_path(profile_path, sizeof(profile_path));
+  if (use_autotune) {
+    if (!aes128tune_run(&profile, stderr)) {
+      fprintf(stderr, "error: Calibration failed\n");
+      return 7;
+    }
+    aes128tune_apply(&profile, &config);
+    fprintf(stderr, "autotune: %s engine, %lu threads x %lu blocks for "
+      "files of %lu bytes or more, io_uring depth %lu\n",
+      aes128_engine_name(profile.engine), profile.threads, profile.blocks,
+      profile.threshold, profile.depth);
+    if (have_path && aes128tune_save(&profile, profile_path))
+      fprintf(stderr, "autotune: Saved profile to %s\n", profile_path);
+    else
+      fprintf(stderr, "warning: Could not save the tuned profile\n");
+    // Calibrating alone does not need a file to crypt
+    if (argc == optind) return 0;
+  } else if (have_path && aes128tune_load(&profile, profile_path))
+    aes128tune_apply(&profile, &config);
+  // Options given on the command line override everything else
+  if (cli.threads > 0) config.threads = cli.threads;
+  if (cli.blocks  > 0) config.blocks  = cli.blocks;
+  if (cli.depth   > 0) config.depth   = cli.depth < AES128URING_MAX_DEPTH ?
+    cli.depth : AES128URING_MAX_DEPTH;
+  char** args = argv + optind;
   // Ensure that the minimum of three arguments was provided
-  if (argc < 4) {
+  if (argc - optind < 3) {
     fprintf(stderr, "error: Not enough arguments.\n");
     usage(argc, argv);
     return 1;
   }
+  // A batch names its files through a directory or a list of paths
+  if (use_batch && (use_range || shard_count > 0 || use_direct ||
+      use_mmap || use_uring || manifest != NULL || output != NULL)) {
+    fprintf(stderr, "error: --batch crypts whole files in place with "
+      "positional I/O\n");
+    usage(argc, argv);
+    return 1;
+  } else if (!use_batch && nonces != NULL) {
+    fprintf(stderr, "error: --nonces requires --batch\n");
+    usage(argc, argv);
+    return 1;
+  }
+  // Pipes, terminals and "-" (standard input) are streamed rather than
+  // crypted in place
+  use_stream = !use_batch && (strcmp(args[0], "-") == 0 ||
+    (stat(args[0], &st) == 0 && !S_ISREG(st.st_mode)));
+  // Only the worker pools of whole-file runs keep counters
+  if (use_stats && (use_batch || use_stream || use_range ||
+      shard_count > 0 || use_mmap || use_uring || output != NULL)) {
+    fprintf(stderr, "error: --stats covers whole files crypted in place "
+      "by the default,\n--pread or --direct paths\n");
+    usage(argc, argv);
+    return 1;
+  }
+  if (use_stream && (use_range || shard_count > 0 || use_direct ||
+      use_mmap || use_uring || manifest != NULL)) {
+    fprintf(stderr, "error: A stream can only be crypted from start to "
+      "end\n");
+    usage(argc, argv);
+    return 1;
+  } else if (!use_stream && output != NULL && (use_range ||
+      shard_count > 0 || use_direct || use_mmap || use_uring ||
+      manifest != NULL)) {
+    fprintf(stderr, "error: --output copies the whole file with "
+      "positional I/O\n");
+    usage(argc, argv);
+    return 1;
+  }
   errno = 0;
-  // Attempt to open the file at the path held by the first argument
-  if ((fp = fopen(argv[1], "r+b")) == NULL) {
+  // Attempt to open the file at the path held by the first argument; a
+  // file copied to --output is only ever read
+  if (!use_stream && !use_batch && (fp = fopen(args[0], output != NULL ?
+      "rb" : "r+b")) == NULL) {
     perror("file: fopen()");
     usage(argc, argv);
     return 2;
   }
   // Determine the size of the file
-  fseek(fp, 0, SEEK_END); size = ftell(fp); fclose(fp); fp = NULL;
+  if (!use_stream && !use_batch) {
+    fseek(fp, 0, SEEK_END); size = ftell(fp); fclose(fp); fp = NULL;
+  }
+  // A shard is just a range computed from the file size
+  if (shard_count > 0 && use_range) {
+    fprintf(stderr, "error: --shard cannot be combined with --offset or "
+      "--length\n");
+    usage(argc, argv);
+    return 1;
+  } else if (shard_count > 0) {
+    aes128ctr_shard(size, shard_index, shard_count, &offset, &length);
+    use_range = 1;
+    // Each shard reports to its own manifest unless told otherwise
+    if (manifest == NULL) {
+      snprintf(manifest_path, sizeof(manifest_path), "%s.shard-%lu-of-%lu",
+        args[0], shard_index, shard_count);
+      manifest = manifest_path;
+    }
+  } else if (use_range && offset >= size) {
+    fprintf(stderr, "error: offset is beyond the end of the file\n");
+    usage(argc, argv);
+    return 1;
+  }
+  // Anything past the end of the file is left out of the range
+  if (use_range && length > size - offset) length = size - offset;
+  // A range is crypted in place with positional I/O, so it cannot be
+  // combined with the whole-file drivers
+  if (use_range && (use_direct || use_mmap || use_uring)) {
+    fprintf(stderr, "error: --offset, --length and --shard only support "
+      "--pread\n");
+    usage(argc, argv);
+    return 1;
+  }
+  const size_t expected = use_range ? (size_t)length : size;
   // Ensure that the provided NONCE argument is the correct length
-  if (strlen(argv[2]) != 16) {
+  if (strlen(args[1]) != 16) {
     fprintf(stderr, "error: nonce must be 16 hexadecimal characters\n");
     usage(argc, argv);
     return 3;
   }
   errno = 0;
   // Attempt to read the NONCE held by the second argument
-  { uint64_t tmp = htonll(strtoull(argv[2], NULL, 16));
+  { uint64_t tmp = htonll(strtoull(args[1], NULL, 16));
   memcpy(nonce.val, &tmp, 8); tmp = 0; }
   if (errno != 0) {
     perror("nonce: strtoull()");
@@ -78,19 +276,19 @@ int main(int argc, char* argv[]) {
     return 4;
   }
   // Ensure that the provided KEY argument is the correct length
-  if (strlen(argv[3]) != 32) {
+  if (strlen(args[2]) != 32) {
     fprintf(stderr, "error: key must be 32 hexadecimal characters\n");
     usage(argc, argv);
     return 5;
   }
   errno = 0;
   // Attempt to read the low portion of the key first
-  { uint64_t tmp = htonll(strtoull(argv[3] + 16, NULL, 16));
+  { uint64_t tmp = htonll(strtoull(args[2] + 16, NULL, 16));
   memcpy(key.val + 8, &tmp, 8); tmp = 0; }
   // Replace the first byte of the low portion with a NULL character
-  argv[3][16] = 0;
+  args[2][16] = 0;
   // Finally, attempt to read the high portion of the key
-  { uint64_t tmp = htonll(strtoull(argv[3],      NULL, 16));
+  { uint64_t tmp = htonll(strtoull(args[2],      NULL, 16));
   memcpy(key.val,     &tmp, 8); tmp = 0; }
   // Check for an error during either HIGH/LOW strtoull() operation
   if (errno != 0) {
@@ -98,17 +296,56 @@ int main(int argc, char* argv[]) {
     usage(argc, argv);
     return 6;
   }
+  // A batch sets up its own context around the raw key
+  if (use_batch) {
+    int result = crypt_batch(args[0], nonces, &config);
+    memset(nonce.val, 0, sizeof(nonce.val));
+    memset(  key.val, 0, sizeof(  key.val));
+    return result;
+  }
   // Create some state to store the status and duration of the ops
   size_t status = 0; struct timespec start = {0, 0}, end = {0, 0};
   // Attempt to initialize the key and crypt the file
   aes128_key_init(&key);
   clock_gettime(CLOCK_MONOTONIC, &start);
-  #if (AES128CTR_WORKER_COUNT == 1)
-    status = aes128ctr_crypt_path(&nonce, &key, argv[1]);
-  #else
-    status = aes128ctr_crypt_path_pthread(&nonce, &key, argv[1],
-      AES128CTR_WORKER_COUNT);
-  #endif
+  if (use_stream) {
+    // Read standard input or the named pipe, and write standard output or
+    // the requested file
+    int in_fd = strcmp(args[0], "-") == 0 ? STDIN_FILENO :
+      open(args[0], O_RDONLY);
+    int out_fd = output == NULL ? STDOUT_FILENO :
+      open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stream_ok = in_fd >= 0 && out_fd >= 0 && aes128ctr_crypt_stream(
+      &nonce, &key, in_fd, out_fd, &config, &streamed);
+    if (in_fd  > STDERR_FILENO) close(in_fd);
+    if (out_fd > STDERR_FILENO && close(out_fd) != 0) stream_ok = 0;
+    status = (size_t)streamed;
+  } else if (output != NULL)
+    status = aes128ctr_crypt_path_copy(&nonce, &key, args[0], output,
+      &config);
+  else if (use_range && length == 0)
+    status = 0;
+  else if (use_range)
+    status = aes128ctr_crypt_path_range(&nonce, &key, args[0], offset,
+      length, &config);
+  else if (use_uring)
+    status = aes128uring_crypt_path(&nonce, &key, args[0], &config,
+      &uring_stats);
+  else if (use_direct)
+    status = aes128ctr_crypt_path_direct(&nonce, &key, args[0], &config,
+      use_stats ? &stats : NULL);
+  else if (use_mmap)
+    status = aes128ctr_crypt_path_mmap(&nonce, &key, args[0], &config);
+  else if (use_pread)
+    status = aes128ctr_crypt_path_pread(&nonce, &key, args[0], &config,
+      use_stats ? &stats : NULL);
+  // Counters come from the worker pool, so --stats always starts one
+  else if (!use_stats && (config.threads == 1 || (cli.threads == 0 &&
+      size < config.threshold)))
+    status = aes128ctr_crypt_path(&nonce, &key, args[0]);
+  else
+    status = aes128ctr_crypt_path_pthread(&nonce, &key, args[0], &config,
+      use_stats ? &stats : NULL);
   clock_gettime(CLOCK_MONOTONIC, &end);
   timespec_diff(&start, &end);
   double duration = ((double)end.tv_sec + (end.tv_nsec / 1000000000.0));
@@ -116,16 +353,201 @@ int main(int argc, char* argv[]) {
   memset(nonce.val, 0, sizeof(nonce.val));
   memset(  key.val, 0, sizeof(  key.val));
   // Check the status of the cryption operation
-  if (status != size) {
+  if (use_stream ? !stream_ok : status != expected) {
     fprintf(stderr, "error: Cryption failed\n");
+    aes128ctr_stats_destroy(&stats);
     return 127;
   }
   fprintf(stderr, "success: Crypted %f MB in %f sec (%f MB/s)\n",
     (status / (double)(1 << 20)),  duration,
     (status / (double)(1 << 20)) / duration);
+  // Report how deep the io_uring queue actually ran
+  if (use_uring && uring_stats.fallback)
+    fprintf(stderr, "io_uring: unavailable; used the pread() path\n");
+  else if (use_uring)
+    fprintf(stderr, "io_uring: depth %lu requested, %.1f average, %lu peak "
+      "(%f MB/s)\n", uring_stats.depth, uring_stats.depth_avg,
+      uring_stats.depth_max, uring_stats.seconds > 0 ? (uring_stats.bytes /
+      (double)(1 << 20)) / uring_stats.seconds : 0);
+  // Break the run down by thread on standard output
+  if (use_stats) print_stats(&stats, status, stats_json);
+  aes128ctr_stats_destroy(&stats);
+  // Record the finished range once it is on disk, so that a coordinator
+  // can verify that every shard completed
+  if (manifest != NULL) {
+    int fd = open(args[0], O_WRONLY);
+    int synced = fd >= 0 && fdatasync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!synced || !write_manifest(manifest, args[0], shard_index,
+        shard_count, offset, status, duration)) {
+      fprintf(stderr, "error: Could not write the manifest %s\n", manifest);
+      return 8;
+    }
+  }
   return 0;
 }
 
+int crypt_batch(const char* list, const char* nonces,
+    const aes128ctr_config_t* config) {
+  aes128batch_t batch; aes128ctr_ctx_t ctx; struct stat st;
+  struct timespec start = {0, 0}, end = {0, 0}; int result = 0;
+  if (!aes128batch_init(&batch)) {
+    perror("batch: malloc()");
+    return 2;
+  }
+  // Walk a directory tree, or read one path per line from a list
+  int listed = 0;
+  if (strcmp(list, "-") == 0)
+    listed = aes128batch_read_list(&batch, stdin);
+  else if (stat(list, &st) == 0 && S_ISDIR(st.st_mode))
+    listed = aes128batch_walk(&batch, list);
+  else {
+    FILE* fp = fopen(list, "r");
+    listed = fp != NULL && aes128batch_read_list(&batch, fp);
+    if (fp != NULL) fclose(fp);
+  }
+  if (!listed) {
+    perror("batch: Could not list the files");
+    aes128batch_destroy(&batch);
+    return 2;
+  }
+  // Crypting one file twice would restore it, so refuse duplicates
+  size_t first, second;
+  if (aes128ctr_batch_duplicate(batch.files, batch.count, &first, &second)) {
+    fprintf(stderr, "error: %s and %s name the same file\n",
+      batch.files[first].path, batch.files[second].path);
+    aes128batch_destroy(&batch);
+    return 4;
+  }
+  // One context and pool serves the whole batch
+  if (!aes128ctr_ctx_init(&ctx, &key, &nonce, AES128CTR_NONCE_FIXED,
+      config)) {
+    perror("batch: aes128ctr_ctx_init()");
+    aes128batch_destroy(&batch);
+    return 2;
+  }
+  // Take each nonce from the manifest, or derive it from the file's label
+  if (nonces != NULL && !aes128batch_load_nonces(&batch, nonces)) {
+    fprintf(stderr, "error: %s does not hold a valid nonce for every "
+      "file\n", nonces);
+    result = 4;
+  } else if (nonces == NULL)
+    aes128batch_derive_nonces(&batch, &nonce, &ctx.key);
+  uint64_t bytes = 0; size_t done = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (result == 0)
+    done = aes128ctr_ctx_crypt_batch(&ctx, batch.files, batch.count);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  timespec_diff(&start, &end);
+  double duration = ((double)end.tv_sec + (end.tv_nsec / 1000000000.0));
+  aes128ctr_ctx_destroy(&ctx);
+  // Name every file that could not be crypted
+  for (size_t i = 0; result == 0 && i < batch.count; ++i)
+    if (batch.files[i].done)
+      bytes += batch.files[i].size;
+    else
+      fprintf(stderr, "error: Cryption failed for %s\n",
+        batch.files[i].path);
+  if (result == 0 && done != batch.count)
+    result = 127;
+  else if (result == 0)
+    fprintf(stderr, "success: Crypted %lu files (%f MB) in %f sec "
+      "(%.1f files/s)\n", done, bytes / (double)(1 << 20), duration,
+      duration > 0 ? done / duration : 0);
+  aes128batch_destroy(&batch);
+  return result;
+}
+
+int parse_bytes(const char* text, uint64_t* value) {
+  char* end = NULL; errno = 0;
+  // Accept any decimal integer, including zero, with nothing trailing it
+  unsigned long long parsed = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || *end != 0 || *text == '-') return 0;
+  *value = (uint64_t)parsed;
+  return 1;
+}
+
+int parse_count(const char* text, size_t* value) {
+  char* end = NULL; errno = 0;
+  // Accept only a positive decimal integer with nothing trailing it
+  unsigned long long parsed = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || *end != 0 || parsed == 0) return 0;
+  *value = (size_t)parsed;
+  return 1;
+}
+
+int parse_shard(const char* text, size_t* index, size_t* count) {
+  char* end = NULL; errno = 0;
+  // Accept "I/N" where I is a zero-based shard index below N
+  unsigned long long i = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || *end != '/' || *text == '-') return 0;
+  const char* rest = end + 1;
+  unsigned long long n = strtoull(rest, &end, 10);
+  if (errno != 0 || end == rest || *end != 0 || *rest == '-' || i >= n)
+    return 0;
+  *index = (size_t)i; *count = (size_t)n;
+  return 1;
+}
+
+int write_manifest(const char* path, const char* file, size_t index,
+    size_t count, uint64_t offset, size_t bytes, double seconds) {
+  char temp[4096];
+  // Write a sibling file first so that a coordinator never sees half a
+  // manifest
+  if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+    return 0;
+  FILE* fp = fopen(temp, "w");
+  if (fp == NULL) return 0;
+  fprintf(fp, "file=%s\nsize=%lu\n", file, size);
+  if (count > 0) fprintf(fp, "shard=%lu/%lu\n", index, count);
+  fprintf(fp, "offset=%lu\nlength=%lu\ncounter=%lu\nseconds=%f\n"
+    "status=done\n", offset, bytes, offset >> 4, seconds);
+  if (fclose(fp) != 0 || rename(temp, path) != 0) {
+    unlink(temp); return 0;
+  } return 1;
+}
+
+void print_stats(const aes128ctr_stats_t* stats, size_t bytes, int json) {
+  char name[32];
+  if (json)
+    printf("{\"bytes\": %lu, \"seconds\": %f, \"threads\": %lu, "
+      "\"steals\": %lu, ", bytes, stats->seconds, stats->threads,
+      stats->steals);
+  else
+    printf("stats: %lu bytes in %f sec on %lu workers, %lu chunks stolen\n",
+      bytes, stats->seconds, stats->threads, stats->steals);
+  // The I/O threads and the sum over all workers come first
+  print_thread_stats("reader", &stats->reader, json);
+  print_thread_stats("writer", &stats->writer, json);
+  print_thread_stats("total",  &stats->total,  json);
+  if (json) printf("\"workers\": [");
+  for (size_t i = 0; i < stats->threads; ++i) {
+    snprintf(name, sizeof(name), "worker%lu", i);
+    if (json && i > 0) printf(", ");
+    print_thread_stats(json ? NULL : name, &stats->workers[i], json);
+  }
+  if (json) printf("]}\n");
+}
+
+void print_thread_stats(const char* name,
+    const aes128ctr_thread_stats_t* stats, int json) {
+  // Named objects are members of the report; unnamed ones array elements
+  if (json)
+    printf("%s%s%s{\"chunks\": %lu, \"blocks\": %lu, \"crypt_seconds\": "
+      "%f, \"wait_seconds\": %f, \"read_bytes\": %lu, \"read_seconds\": "
+      "%f, \"write_bytes\": %lu, \"write_seconds\": %f}%s",
+      name != NULL ? "\"" : "", name != NULL ? name : "",
+      name != NULL ? "\": " : "", stats->chunks, stats->blocks,
+      stats->crypt_seconds, stats->wait_seconds, stats->read_bytes,
+      stats->read_seconds, stats->write_bytes, stats->write_seconds,
+      name != NULL ? ", " : "");
+  else
+    printf("  %-9s chunks=%lu blocks=%lu crypt=%fs wait=%fs read=%luB/%fs "
+      "write=%luB/%fs\n", name, stats->chunks, stats->blocks,
+      stats->crypt_seconds, stats->wait_seconds, stats->read_bytes,
+      stats->read_seconds, stats->write_bytes, stats->write_seconds);
+}
+
 void timespec_diff(const struct timespec* start, struct timespec* end) {
   if ((end->tv_nsec - start->tv_nsec) < 0) {
     end->tv_sec  -= start->tv_sec  - 1;
@@ -138,9 +560,60 @@ void timespec_diff(const struct timespec* start, struct timespec* end) {
 
 void usage(int argc, char* argv[]) {
   if (argc > 0) {
-    fprintf(stderr, "\nUsage: %s <file> <nonce> <key>\n", argv[0]);
+    fprintf(stderr, "\nUsage: %s [options] <file> <nonce> <key>\n", argv[0]);
+    fprintf(stderr, "  * file  may be \"-\" or a pipe to stream stdin to "
+                    "stdout\n"
+                    "  * file  is a directory or a list of paths with "
+                    "--batch\n");
     fprintf(stderr, "  * nonce is a  64-bit hexadecimal value\n"
                     "  * key   is a 128-bit hexadecimal value\n");
+    aes128ctr_config_t config; aes128ctr_config_init(&config);
+    fprintf(stderr, "\nOptions:\n"
+                    "  -a, --autotune       calibrate this host and save "
+                    "its profile\n"
+                    "  -d, --direct         bypass the page cache with "
+                    "O_DIRECT\n"
+                    "  -m, --mmap           crypt the file in place through "
+                    "mmap()\n"
+                    "  -p, --pread          workers pread()/pwrite() their "
+                    "own ranges\n"
+                    "  -u, --uring          queue reads and writes through "
+                    "io_uring\n"
+                    "  -t, --threads=N      worker threads (default %lu)\n"
+                    "  -b, --blocks=N       16-byte blocks per chunk "
+                    "(default %lu)\n"
+                    "  -q, --queue-depth=N  io_uring requests kept in flight "
+                    "(default %lu)\n"
+                    "  -o, --offset=BYTES   crypt only from this byte "
+                    "offset\n"
+                    "  -l, --length=BYTES   crypt only this many bytes "
+                    "(default: to the end)\n"
+                    "  -s, --shard=I/N      crypt only shard I (from 0) "
+                    "of N page-aligned shards\n"
+                    "  -M, --manifest=PATH  record the finished range in "
+                    "PATH (default for\n"
+                    "                       shards: <file>.shard-I-of-N)\n"
+                    "  -O, --output=PATH    write to PATH instead of "
+                    "crypting in place\n"
+                    "  -B, --batch          crypt every file listed by "
+                    "<file> on one pool\n"
+                    "  -N, --nonces=PATH    per-file nonces for --batch, "
+                    "one \"<nonce> <path>\"\n"
+                    "                       per line (default: derived "
+                    "from the nonce and the\n"
+                    "                       path below the directory, or "
+                    "the absolute path)\n"
+                    "  -S, --stats[=FORMAT] print per-thread counters as "
+                    "text or json\n"
+                    "  -T, --trace=PATH     write a Chrome trace of every "
+                    "chunk to PATH at exit\n"
+                    "  -h, --help           show this message\n"
+                    "\nThe defaults follow the processor count and L2 cache "
+                    "size, and may be\noverridden by AES128CTR_THREADS, "
+                    "AES128CTR_BLOCKS and AES128CTR_DEPTH.\nA profile saved "
+                    "by --autotune is loaded from AES128CTR_PROFILE or\n"
+                    "~/.cache/aes128ctr.profile.\n",
+                    config.threads, config.blocks, config.depth);
   } else {
     fprintf(stderr, "error: argc <= 0\n");
   }
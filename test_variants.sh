@@ -1,9 +1,12 @@
 #!/bin/bash
-# Tests all variants of the program based on worker count and size
+# Tests the program across worker counts and chunk sizes
 
 # Exit on error
 set -e
 
+# Build the single binary; every setting below is chosen at run time
+make
+
 # Fetch a random nonce and key value
 NCE=$(hexdump -n  8 -e '4/4 "%08X" 1 "\n"' /dev/urandom)
 KEY=$(hexdump -n 16 -e '4/4 "%08X" 1 "\n"' /dev/urandom)
@@ -16,7 +19,7 @@ do
   # Test the single threaded application separately
   for k in {1..16}
   do
-    ./main_1w_*b ./test.bin $NCE $KEY 2>&1 | \
+    ./main -t 1 ./test.bin $NCE $KEY 2>&1 | \
       awk '{printf "1,1,%d,1:1:%d,%f,%f\n", $3, $3, $6, $3/$6}'
   done
 
@@ -26,10 +29,10 @@ do
     # Iterate over each worker size to be tested
     for ((j = 32; j <= 16384; j *= 2))
     do
-      # Test this variant with `i` workers that operate on `j` blocks
+      # Test `i` workers that operate on `j` blocks
       for k in {1..16}
       do
-        ./main_${i}w_${j}b ./test.bin $NCE $KEY 2>&1 | \
+        ./main -t $i -b $j ./test.bin $NCE $KEY 2>&1 | \
           awk '{printf "'$i,$j',%d,'$i:$j':%d,%f,%f\n", $3, $3, $6, $3/$6}'
       done
     done